@@ -0,0 +1,43 @@
+// ****************************************
+// Shift-And (bitap) matcher for IUPAC motifs
+// ----------------------------------------
+
+#include "bitap.h"
+#include "motifSearch.h"
+
+void bitap_init(bitap_t *b, const char *motif)
+{
+    int len = strlen(motif);
+    if (len == 0 || len > BITAP_MAX_LEN) fatalf("Error: motif length must be between 1 and %d\n", BITAP_MAX_LEN);
+    memset(b, 0, sizeof(bitap_t));
+    b->len = len;
+    for (int i = 0; i < len; ++i) {
+        uint8_t fwd_mask = iupac_to_mask(motif[i]);
+        /* position i of the reverse complement is the complement of motif[len-1-i] */
+        uint8_t rev_mask = iupac_complement_mask(iupac_to_mask(motif[len - 1 - i]));
+        for (int c = 0; c < 256; ++c) {
+            uint8_t nt = nt_to_mask(c);
+            if (nt & fwd_mask) b->fwd[c] |= 1ULL << i;
+            if (nt & rev_mask) b->rev[c] |= 1ULL << i;
+        }
+    }
+}
+
+/* The state carries over the newlines, which are skipped line segment by line segment */
+void bitap_search(const bitap_t *b, const FastaView *v, bitap_callback_t callback, void *arg)
+{
+    const uint64_t hit = 1ULL << (b->len - 1);
+    uint64_t f = 0, r = 0, n;
+    for (uint64_t pos = 0; pos < v->length; pos += n) {
+        const unsigned char *seq = (const unsigned char *)fastaViewSegment(v, pos, v->length, &n);
+        for (uint64_t i = 0; i < n; ++i) {
+            unsigned char c = seq[i];
+            f = ((f << 1) | 1) & b->fwd[c];
+            r = ((r << 1) | 1) & b->rev[c];
+            if (unlikely((f | r) & hit)) {
+                if (f & hit) callback(arg, pos + i + 1 - b->len, '+');
+                if (r & hit) callback(arg, pos + i + 1 - b->len, '-');
+            }
+        }
+    }
+}
@@ -0,0 +1,32 @@
+// ****************************************
+// Shift-And (bitap) matcher for IUPAC motifs
+// ----------------------------------------
+
+#ifndef _BITAP_H
+#define _BITAP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "fasta.h"
+
+/* Motifs are limited to one machine word of state */
+#define BITAP_MAX_LEN 64
+
+typedef void (*bitap_callback_t)(void *arg, uint64_t pos, char strand);
+
+/**
+ * @brief Character-class masks of a motif and of its reverse complement.
+ * Bit i of fwd[c] is set when the sequence byte c is accepted at motif
+ * position i, so the matching cost only depends on the motif length and
+ * not on how many concrete strings the IUPAC codes expand to.
+ */
+typedef struct bitap {
+    int len;
+    uint64_t fwd[256];
+    uint64_t rev[256];
+} bitap_t;
+
+void bitap_init(bitap_t *b, const char *motif);
+void bitap_search(const bitap_t *b, const FastaView *v, bitap_callback_t callback, void *arg);
+
+#endif
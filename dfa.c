@@ -0,0 +1,140 @@
+// ****************************************
+// Flat DFA compiled from the Aho-Corasick trie
+// ----------------------------------------
+
+#include "dfa.h"
+#include "motifSearch.h"
+
+/* Column of each base in a state row; N and anything else share the last one */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init" /* the bases override the default of the range */
+static const uint8_t ntDfaCode[256] = {
+    [0 ... 255] = 4,
+    ['A'] = 0, ['C'] = 1, ['G'] = 2, ['T'] = 3,
+    ['a'] = 0, ['c'] = 1, ['g'] = 2, ['t'] = 3,
+};
+#pragma GCC diagnostic pop
+
+/**
+ * @brief Patterns come from parse_motif_pattern: all of the same length,
+ * forward strand at even indices and the reverse complement at odd ones.
+ * The trie is built first, then a breadth-first pass resolves the failure
+ * links into the transitions of every state.
+ */
+void dfa_init(dfa_t *d, const char **pattern, int n_patterns)
+{
+    int len = strlen(pattern[0]);
+    uint32_t max_states = 1 + (uint32_t)n_patterns * len, n_states = 1;
+    int32_t (*child)[4] = malloc(max_states * sizeof(*child));
+    uint32_t *fail = calloc(max_states, sizeof(uint32_t));
+    uint32_t *queue = malloc(max_states * sizeof(uint32_t));
+    uint8_t *out = calloc(max_states, 1);
+    if (!child || !fail || !queue || !out) fatal("Memory allocation failed");
+    memset(child, -1, max_states * sizeof(*child));
+
+    for (int i = 0; i < n_patterns; ++i) {
+        uint32_t s = 0;
+        for (int j = 0; j < len; ++j) {
+            int c = ntDfaCode[(unsigned char)pattern[i][j]];
+            if (c == 4) fatalf("Error: pattern %s is not a DNA string\n", pattern[i]);
+            if (child[s][c] < 0) child[s][c] = n_states++;
+            s = child[s][c];
+        }
+        out[s] |= (i % 2) == 0 ? DFA_FWD : DFA_REV;
+    }
+
+    d->len = len;
+    d->n_states = n_states;
+    d->trans = calloc((size_t)n_states * DFA_STRIDE, sizeof(uint32_t));
+    if (!d->trans) fatal("Memory allocation failed");
+    /* the default transitions of the root, and N from any state, go back to the root */
+    uint32_t head = 0, tail = 0;
+    for (int c = 0; c < 4; ++c) {
+        int32_t v = child[0][c];
+        if (v > 0) {
+            d->trans[c] = (uint32_t)v * DFA_STRIDE | out[v];
+            queue[tail++] = v;
+        }
+    }
+    /* all patterns share one length, so only leaves have outputs and the
+     * failure chain never adds any */
+    while (head < tail) {
+        uint32_t u = queue[head++];
+        for (int c = 0; c < 4; ++c) {
+            int32_t v = child[u][c];
+            uint32_t via_fail = d->trans[fail[u] * DFA_STRIDE + c];
+            if (v > 0) {
+                fail[v] = via_fail / DFA_STRIDE;
+                d->trans[u * DFA_STRIDE + c] = (uint32_t)v * DFA_STRIDE | out[v];
+                queue[tail++] = v;
+            } else {
+                d->trans[u * DFA_STRIDE + c] = via_fail;
+            }
+        }
+    }
+    free(child);
+    free(fail);
+    free(queue);
+    free(out);
+}
+
+void dfa_destroy(dfa_t *d)
+{
+    free(d->trans);
+    d->trans = NULL;
+}
+
+size_t dfa_memory(const dfa_t *d)
+{
+    return (size_t)d->n_states * DFA_STRIDE * sizeof(uint32_t);
+}
+
+static inline void dfa_report(const dfa_t *d, uint32_t w, uint64_t j, dfa_callback_t callback, void *arg)
+{
+    if (w & DFA_FWD) callback(arg, j + 1 - d->len, '+');
+    if (w & DFA_REV) callback(arg, j + 1 - d->len, '-');
+}
+
+/**
+ * @brief The lookups of one automaton form a dependency chain bound by the
+ * load latency, so the sequence is cut into DFA_LANES slices walked in the
+ * same loop. Lane k reports the hits starting in [k * slice, (k + 1) * slice)
+ * and reads len - 1 bases into the next slice to complete them; the last
+ * lane goes on to the end of the sequence. Slices are whole lines, so the
+ * lanes cross their newlines together.
+ */
+void dfa_search(const dfa_t *d, const FastaView *v, dfa_callback_t callback, void *arg)
+{
+    const uint32_t *trans = d->trans;
+    uint64_t slice = v->length >= (uint64_t)d->len - 1 ? (v->length - (d->len - 1)) / DFA_LANES : 0;
+    slice -= slice % v->line_blen;
+    uint64_t steps = slice ? slice + d->len - 1 : 0, n;
+    /* one register per lane, an array would go through the stack */
+    uint32_t w0 = 0, w1 = 0, w2 = 0, w3 = 0;
+    for (uint64_t t = 0; t < steps; t += n) {
+        const unsigned char *s0 = (const unsigned char *)fastaViewSegment(v, t, steps, &n);
+        const unsigned char *s1 = (const unsigned char *)fastaViewAt(v, slice + t);
+        const unsigned char *s2 = (const unsigned char *)fastaViewAt(v, 2 * slice + t);
+        const unsigned char *s3 = (const unsigned char *)fastaViewAt(v, 3 * slice + t);
+        for (uint64_t i = 0; i < n; ++i) {
+            w0 = trans[(w0 & ~DFA_OUT) + ntDfaCode[s0[i]]];
+            w1 = trans[(w1 & ~DFA_OUT) + ntDfaCode[s1[i]]];
+            w2 = trans[(w2 & ~DFA_OUT) + ntDfaCode[s2[i]]];
+            w3 = trans[(w3 & ~DFA_OUT) + ntDfaCode[s3[i]]];
+            if (unlikely((w0 | w1 | w2 | w3) & DFA_OUT)) {
+                if (w0 & DFA_OUT) dfa_report(d, w0, t + i, callback, arg);
+                if (w1 & DFA_OUT) dfa_report(d, w1, slice + t + i, callback, arg);
+                if (w2 & DFA_OUT) dfa_report(d, w2, 2 * slice + t + i, callback, arg);
+                if (w3 & DFA_OUT) dfa_report(d, w3, 3 * slice + t + i, callback, arg);
+            }
+        }
+    }
+    uint32_t w = w3;
+    for (uint64_t pos = (DFA_LANES - 1) * slice + steps; pos < v->length; pos += n) {
+        const unsigned char *s = (const unsigned char *)fastaViewSegment(v, pos, v->length, &n);
+        for (uint64_t i = 0; i < n; ++i) {
+            w = trans[(w & ~DFA_OUT) + ntDfaCode[s[i]]];
+            if (unlikely(w & DFA_OUT)) dfa_report(d, w, pos + i, callback, arg);
+        }
+    }
+}
@@ -0,0 +1,41 @@
+// ****************************************
+// Flat DFA compiled from the Aho-Corasick trie
+// ----------------------------------------
+
+#ifndef _DFA_H
+#define _DFA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "fasta.h"
+
+/* Transitions per state: A, C, G, T and N, padded to a power of two */
+#define DFA_STRIDE 8
+/* Output flags packed in the low bits of a transition */
+#define DFA_FWD 1
+#define DFA_REV 2
+#define DFA_OUT (DFA_FWD | DFA_REV)
+/* Independent slices of the sequence scanned in the same loop, unrolled in dfa_search */
+#define DFA_LANES 4
+
+typedef void (*dfa_callback_t)(void *arg, uint64_t pos, char strand);
+
+/**
+ * @brief Aho-Corasick automaton of the concrete patterns of a motif with
+ * every failure link resolved, so each base costs a single table lookup.
+ * A transition holds the offset of the next state row (state * DFA_STRIDE)
+ * OR'ed with the strands of the patterns ending in that state.
+ */
+typedef struct dfa {
+    int len;
+    uint32_t n_states;
+    uint32_t *trans;
+} dfa_t;
+
+void dfa_init(dfa_t *d, const char **pattern, int n_patterns);
+void dfa_destroy(dfa_t *d);
+size_t dfa_memory(const dfa_t *d);
+void dfa_search(const dfa_t *d, const FastaView *v, dfa_callback_t callback, void *arg);
+
+#endif
@@ -65,8 +65,8 @@ stringVec split(const char *_s, char *delim)
     stringVec fields;
     kv_init(fields);
     char* tok;
-    char* s = malloc(strlen(_s));
-    memcpy(s, _s, strlen(_s));
+    char* s = malloc(strlen(_s)+1);
+    memcpy(s, _s, strlen(_s)+1);
     tok = strtok(s, delim);
     while (tok != NULL) {
         if (tok[strlen(tok)-1] == '\n') tok[strlen(tok)-1] = '\0';
@@ -79,7 +79,7 @@ stringVec split(const char *_s, char *delim)
 void *writeFastaIndex(char* fasta_file_path, bool full_header, bool return_index)
 {
     int fasta_file_path_len = strlen(fasta_file_path);
-    char *index_file_path = malloc(strlen(fasta_file_path)+4);
+    char *index_file_path = malloc(fasta_file_path_len + 5);
     strcpy(index_file_path, fasta_file_path);
     strcpy(index_file_path + fasta_file_path_len, ".fai");
     FastaIndexEntry *entry = fastaIndexEntryInit();
@@ -251,21 +251,99 @@ FastaIndex *readFastaIndex(char* index_file_path, bool full_header)
 
 void *readFastaByMmap(char* fasta_file_path)
 {
-    FILE* fp;
-    if (!(fp = fopen(fasta_file_path, "r"))) fatalf("Error: could not open fasta file %s\n", fasta_file_path);
-    int fd = fileno(fp); // Get file discriptor for mmap
+    return readFastaByMmap2(fasta_file_path, false, false);
+}
+
+/**
+ * @brief Map the whole FASTA read-only, once per run. populate pre-faults
+ * every page with MAP_POPULATE; hugepages asks for transparent huge pages,
+ * which the kernel only grants to file mappings when built with
+ * CONFIG_READ_ONLY_THP_FOR_FS. Both are ignored where unsupported.
+ */
+struct fmm *readFastaByMmap2(char* fasta_file_path, bool populate, bool hugepages)
+{
+    int flags = MAP_SHARED;
+    int fd = open(fasta_file_path, O_RDONLY);
+    if (fd == -1) fatalf("Error: could not open fasta file %s\n", fasta_file_path);
     struct stat sb;
     if (fstat(fd, &sb) == -1) {
         fatal("Failed to stat the file\n");
     }
+#ifdef MAP_POPULATE
+    if (populate) flags |= MAP_POPULATE;
+#endif
     size_t filesize= sb.st_size;
-    void *filemm = mmap(NULL, filesize, PROT_READ, MAP_SHARED, fd, 0);
+    void *filemm = mmap(NULL, filesize, PROT_READ, flags, fd, 0);
+    if (filemm == MAP_FAILED) fatalf("Error: could not map fasta file %s\n", fasta_file_path);
+#ifdef MADV_HUGEPAGE
+    if (hugepages) madvise(filemm, filesize, MADV_HUGEPAGE);
+#endif
     struct fmm *ret = malloc(sizeof(struct fmm));
     ret->mm = filemm;
     ret->fs = filesize;
+    ret->fd = fd;
     return ret;
 }
 
+void fastaMmapDestroy(struct fmm *m)
+{
+    munmap(m->mm, m->fs);
+    close(m->fd);
+    free(m);
+}
+
+/* Apply an madvise hint to the pages holding [begin, end) of the mapping */
+void fastaMmapAdvise(struct fmm *m, const char *begin, const char *end, int advice)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t b = (begin - (const char *)m->mm) & ~(page - 1);
+    size_t e = end - (const char *)m->mm;
+    if (e > b) madvise((char *)m->mm + b, e - b, advice);
+}
+
+void fastaViewInit(FastaView *v, struct fmm *m, FastaIndexEntry *entry)
+{
+    if (entry->line_blen <= 0 || entry->line_len < entry->line_blen) fatalf("Error: bad line geometry for %s in the index\n", entry->name);
+    v->seq = (const char *)m->mm + entry->offset;
+    v->length = entry->length;
+    v->line_blen = entry->line_blen;
+    v->line_len = entry->line_len;
+    v->phase = 0;
+    if (entry->length && fastaViewAt(v, entry->length - 1) >= (const char *)m->mm + m->fs) {
+        fatalf("Error: %s runs past the end of the fasta file, is the index stale?\n", entry->name);
+    }
+}
+
+void fastaViewFromBuffer(FastaView *v, const char *seq, uint64_t length)
+{
+    v->seq = seq;
+    v->length = length;
+    v->line_blen = FASTA_VIEW_FLAT_LINE;
+    v->line_len = FASTA_VIEW_FLAT_LINE;
+    v->phase = 0;
+}
+
+/* The len bases from pos of a view, as a view of their own */
+void fastaViewSub(const FastaView *v, uint64_t pos, uint64_t len, FastaView *sub)
+{
+    *sub = *v;
+    pos += v->phase;
+    sub->seq = v->seq + pos / v->line_blen * v->line_len;
+    sub->phase = pos % v->line_blen;
+    sub->length = len;
+}
+
+/* Copy len bases from pos, skipping the newlines and converting to upper case */
+void fastaViewCopy(const FastaView *v, uint64_t pos, uint64_t len, char *out)
+{
+    uint64_t n;
+    for (uint64_t end = pos + len; pos < end; pos += n) {
+        const char *s = fastaViewSegment(v, pos, end, &n);
+        for (uint64_t i = 0; i < n; ++i) *out++ = toupper((unsigned char)s[i]);
+    }
+    *out = '\0';
+}
+
 char *getFastaSequenceMmap(void *filemm, FastaIndex *fi, char *seq_name)
 {
     khiter_t k = kh_get(str_hash_t, fi->name_field, seq_name);
@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
@@ -24,6 +25,7 @@ typedef khash_t(str_hash_t) stringMap;
 struct fmm {
     void *mm;
     size_t fs;
+    int fd;
 };
 
 typedef struct FastaIndexEntry {
@@ -35,6 +37,38 @@ typedef struct FastaIndexEntry {
     bool full_header;
 } FastaIndexEntry;
 
+/**
+ * @brief Bases of one entry read in place from the mapping, without a heap
+ * copy: base i is at seq[(i + phase) / line_blen * line_len + (i + phase) %
+ * line_blen], seq pointing to the start of a line and phase being the column
+ * of the first base. A contiguous buffer is a view whose line_len equals
+ * line_blen.
+ */
+typedef struct FastaView {
+    const char *seq;
+    uint64_t length;
+    uint64_t line_blen;
+    uint64_t line_len;
+    uint64_t phase;
+} FastaView;
+
+/* Line width given to contiguous buffers, any value works when there is no newline to skip */
+#define FASTA_VIEW_FLAT_LINE 4096
+
+static inline const char *fastaViewAt(const FastaView *v, uint64_t pos)
+{
+    pos += v->phase;
+    return v->seq + pos / v->line_blen * v->line_len + pos % v->line_blen;
+}
+
+/* Start of the line segment holding pos; *n is set to the bases left on it before end */
+static inline const char *fastaViewSegment(const FastaView *v, uint64_t pos, uint64_t end, uint64_t *n)
+{
+    uint64_t col = (pos + v->phase) % v->line_blen;
+    *n = v->line_blen - col < end - pos ? v->line_blen - col : end - pos;
+    return v->seq + (pos + v->phase) / v->line_blen * v->line_len + col;
+}
+
 FastaIndexEntry *fastaIndexEntryInit();
 FastaIndexEntry *fastaIndexEntryInitData(char* name, uint64_t length, uint64_t offset, uint64_t line_blen, uint64_t line_len, bool full_header);
 void fastaIndexEntryDestory(FastaIndexEntry* entry);
@@ -56,6 +90,13 @@ void indexToFile(FastaIndex *fi, FILE* op);
 void entryToFile(FastaIndexEntry *entry, FILE* op);
 void indexToStdout(FastaIndex *fi);
 void *readFastaByMmap(char* fasta_file_path);
+struct fmm *readFastaByMmap2(char* fasta_file_path, bool populate, bool hugepages);
+void fastaMmapDestroy(struct fmm *m);
+void fastaMmapAdvise(struct fmm *m, const char *begin, const char *end, int advice);
+void fastaViewInit(FastaView *v, struct fmm *m, FastaIndexEntry *entry);
+void fastaViewFromBuffer(FastaView *v, const char *seq, uint64_t length);
+void fastaViewSub(const FastaView *v, uint64_t pos, uint64_t len, FastaView *sub);
+void fastaViewCopy(const FastaView *v, uint64_t pos, uint64_t len, char *out);
 char *getFastaSequenceMmap(void *filemm, FastaIndex *fi, char *seq_name);
 char *getFastaSequenceMmap2(void *filemm, FastaIndexEntry *entry);
 FastaIndex *readFastaIndex(char* index_file_path, bool full_header) ;
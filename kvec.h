@@ -112,18 +112,18 @@ int main() {
 			}												\
 			if (i < j)										\
 			{												\
-				kv_swap(type, (v).a[i++], (v).a[j]);		\	
+				kv_swap(type, (v).a[i++], (v).a[j]);		\
 			}												\
 			while (i < j && comp(kv_A(v, i), x) <= 0) {		\
 				i++;										\
-			}												\	
+			}												\
 			if (i < j)										\
 			{												\
 				kv_swap(type, (v).a[j--], (v).a[i]);		\
-			}												\	
-		}													\	
+			}												\
+		}													\
 		(v).a[i] = x;										\
 		kv_sort(type, v, l, i - 1, comp);					\
 		kv_sort(type, v, i + 1, r, comp);					\
 	}														\
-} while(0);
\ No newline at end of file
+} while(0);
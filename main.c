@@ -1,21 +1,53 @@
 #include <getopt.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+#include <zlib.h>
+#include "kseq.h"
 #include "thread_pool.h"
 #include "motifSearch.h"
 #include "fasta.h"
+#include "regions.h"
 
 #define MIN(a,b) (a) < (b) ? (a) : (b)
 #define MAX_THREADS  sysconf(_SC_NPROCESSORS_ONLN)
 #define MAX_CHROM 100
+/* Auto windows: a few per thread so that the last ones even out, never below this */
+#define WINDOWS_PER_THREAD 4
+#define MIN_WINDOW (1 << 20)
+/* --sorted holds the hits of the jobs queued, running and unread until the earlier jobs are out:
+   short windows bound the hits of each job, whatever the density of the motif */
+#define SORTED_WINDOW (1 << 16)
 
 void version()
 {
     printf("Snow's motifSearch version 0.0.3\n");
     printf("Usage:\n");
-    printf("\t-f/--fasta\tfasta file\n");
+    printf("\t-f/--fasta\tfasta file, - for stdin\n");
     printf("\t-m/--motif\tmotif string\n");
     printf("\t-p/--nthreads\tnumber of threads\n");
+    printf("\t-w/--pwm\tHOMER motif file, scanned instead of -m with the threshold of its first motif\n");
+    printf("\t-M/--library\tHOMER motif library, every motif is scanned in one pass over the genome\n");
+    printf("\t-e/--engine\tmatching engine: auto, dfa, aho, bitap, simd, myers or pwm [auto]\n");
+    printf("\t-k/--kernel\tscanning kernel: auto, avx512, avx2, sse42 or scalar [auto]\n");
+    printf("\t-x/--mismatches\treport sites within this Hamming distance, on the score column [0]\n");
+    printf("\t-d/--edits\treport sites within this edit distance, on the score column [0]\n");
+    printf("\t--populate\tpre-fault the whole FASTA mapping (MAP_POPULATE)\n");
+    printf("\t--hugepages\task for transparent huge pages on the FASTA mapping\n");
+    printf("\t--page-faults\treport the page faults of the run on stderr\n");
+    printf("\t--work-stealing\tschedule the jobs with per-thread queues instead of one shared queue\n");
+    printf("\t-R/--regions\tBED file of target regions; only they are scanned and the ids of those around a hit end it\n");
+    printf("\t-o/--output\tBED file written by all threads at once, sorted like --sorted [stdout]\n");
+    printf("\t--sorted\twrite the hits in .fai order and by coordinate, the same for any number of threads\n");
+    printf("\t--count\t\tprint the hits per chromosome, motif and strand as a table instead of the hits\n");
+    printf("\t--summary\tprint the hits per chromosome and per motif as JSON instead of the hits\n");
+    printf("\t--bin-size\tprint the hits per bin of this many bases as bedGraph instead of the hits\n");
+    printf("\t--verbose\treport the makespan and the idle time of each thread on stderr\n");
+    printf("\t--stream\tread FASTA/FASTQ records (plain or gzipped) without a .fai, as for stdin and pipes\n");
+    printf("\t--window\tbases per job, longer chromosomes are split into overlapping windows [auto]\n");
 }
 
 void usage()
@@ -24,24 +56,292 @@ void usage()
     printf("");
 }
 
-void *test(void *arg) {
-    struct par_arg *parg = (struct par_arg *) arg;
-    printf("entry %s\n", parg->entry->name);
+static int cmp_entry_offset(const void *a, const void *b)
+{
+    const FastaIndexEntry *x = *(FastaIndexEntry *const *)a, *y = *(FastaIndexEntry *const *)b;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/* Longest job first: a long job started last would stretch the end of the run */
+static int cmp_par_arg_bases(const void *a, const void *b)
+{
+    const struct par_arg *x = (const struct par_arg *)a, *y = (const struct par_arg *)b;
+    return (x->n_bases < y->n_bases) - (x->n_bases > y->n_bases);
+}
+
+/* File order of the jobs, the order of their slices in the output file */
+static int cmp_par_arg_file(const void *a, const void *b)
+{
+    const struct scan_unit *x = &kv_A((*(struct par_arg *const *)a)->units, 0), *y = &kv_A((*(struct par_arg *const *)b)->units, 0);
+    if (x->entry->offset != y->entry->offset) return x->entry->offset < y->entry->offset ? -1 : 1;
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+/* Queue a job, waiting while the queue of the pool is full */
+static void dispatch_par_arg(tpool_t *p, tpool_process_t *q, void *(*func)(void *), struct par_arg *arg)
+{
+    if (tpool_dispatch(p, q, func, (void *)arg, NULL, NULL, false) == -1) fatal("Error: could not queue a job");
+}
+
+/**
+ * @brief Second pass of the file output. The jobs have spilled their sorted
+ * hits, formatted; a prefix sum of their bytes in file order gives the
+ * offset of each slice, and the slices are copied to the file in parallel.
+ * Nothing is scanned or formatted again.
+ */
+static void write_jobs(tpool_t *p, tpool_process_t *q, struct par_arg *jobs, size_t n_jobs, int fd)
+{
+    struct par_arg **order = malloc(n_jobs * sizeof(struct par_arg *));
+    uint64_t offset = 0;
+    for (size_t i = 0; i < n_jobs; ++i) order[i] = &jobs[i];
+    qsort(order, n_jobs, sizeof(struct par_arg *), cmp_par_arg_file);
+    for (size_t i = 0; i < n_jobs; ++i) {
+        order[i]->out_offset = offset;
+        offset += order[i]->out_bytes;
+    }
+    free(order);
+    if (ftruncate(fd, offset) < 0) fatal("Error: could not size the output file");
+    /* LPT order again, the biggest slices first */
+    for (size_t i = 0; i < n_jobs; ++i) {
+        if (!jobs[i].out_bytes) continue;
+        if (tpool_dispatch(p, q, write_par_arg, (void *)&jobs[i], NULL, NULL, false) == -1) fatal("Error: could not queue a job");
+    }
+    tpool_process_flush(q);
+}
+
+/* Pass the results ready in job order to the output thread */
+static void send_results(tpool_process_t *q)
+{
+    tpool_result_t *r;
+    while ((r = tpool_next_result(q))) {
+        output_send((output_buf_t *)r->data);
+        tpool_delete_result(r, false);
+    }
+}
+
+/* Sorted output: the jobs go in file order and their hits are streamed as soon as the previous ones are out */
+static void dispatch_par_arg_sorted(tpool_t *p, tpool_process_t *q, void *(*func)(void *), struct par_arg *arg)
+{
+    while (tpool_dispatch(p, q, func, (void *)arg, NULL, NULL, true) == -1) {
+        if (tpool_process_is_shutdown(q)) fatal("Error: could not queue a job");
+        tpool_result_t *r = tpool_next_result_wait(q);
+        if (!r) fatal("Error: could not queue a job");
+        output_send((output_buf_t *)r->data);
+        tpool_delete_result(r, false);
+    }
+    send_results(q);
+}
+
+typedef kvec_t(FastaIndexEntry *) entryVec;
+
+/* Streaming input, plain or gzipped, from a file or stdin */
+KSEQ_INIT(gzFile, gzread)
+
+/* Streaming jobs back on a free list, with their units and buffer */
+static void free_stream_jobs(struct par_arg *arg)
+{
+    for (struct par_arg *next; arg; arg = next) {
+        next = arg->next;
+        kv_destroy(arg->units);
+        free(arg->stream_buf);
+        free(arg);
+    }
+}
+
+/**
+ * @brief Streaming input: the records are read with kseq from a file or
+ * stdin, plain or gzipped, and cut into windows like the entries of an
+ * indexed FASTA. Each job gets a copy of the bases of its windows; the
+ * dispatch waits while the queue is full, so only the queued and running
+ * jobs hold sequence. Finished jobs push themselves on *done, and are
+ * taken back with their units and buffer, as the pool recycles its jobs,
+ * so a long stream does not malloc a job or a buffer per window. The
+ * records are kept as entries, their names are printed until the end of
+ * the run.
+ */
+static size_t stream_jobs(tpool_t *p, tpool_process_t *q, const struct par_arg *tmpl, const char *path,
+                          uint64_t window, bool sorted, entryVec *records, struct par_arg **done)
+{
+    gzFile fp = strcmp(path, "-") ? gzopen(path, "r") : gzdopen(fileno(stdin), "r");
+    if (!fp) fatalf("Error: could not open %s\n", path);
+    kseq_t *ks = kseq_init(fp);
+    struct par_arg *arg = NULL, *free_args = NULL;
+    size_t n_jobs = 0, buf_len = 0;
+    int ret;
+    while ((ret = kseq_read(ks)) >= 0) {
+        if (!ks->name.l) fatalf("Error: record without a name in %s\n", path);
+        uint64_t length = ks->seq.l, start = 0;
+        /* the rank of a record is its number, sorted output keeps the input order */
+        FastaIndexEntry *entry = fastaIndexEntryInitData(strdup(ks->name.s), length, kv_size(*records), length, length, false);
+        kv_push(FastaIndexEntry *, *records, entry);
+        do {
+            struct scan_unit u;
+            u.chrom = entry->name;
+            u.entry = entry;
+            u.idx = kv_size(*records) - 1;
+            u.start = start;
+            u.end = tmpl->engine != ENGINE_MYERS && length - start > window ? start + window : length;
+            u.limit = length;
+            u.region = NULL;
+            start = u.end;
+            uint64_t scan_end = u.end + tmpl->overlap < length ? u.end + tmpl->overlap : length;
+            if (!arg) {
+                if (!free_args) free_args = __atomic_exchange_n(done, NULL, __ATOMIC_ACQUIRE);
+                if (free_args) {
+                    arg = free_args;
+                    free_args = arg->next;
+                } else {
+                    if (!(arg = malloc(sizeof(struct par_arg)))) fatal("Memory allocation failed");
+                    kv_init(arg->units);
+                    arg->stream_buf = NULL;
+                    arg->stream_buf_size = 0;
+                }
+                scanUnitVec units = arg->units;
+                char *buf = arg->stream_buf;
+                size_t buf_size = arg->stream_buf_size;
+                *arg = *tmpl;
+                arg->units = units;
+                arg->units.n = 0;
+                arg->stream_buf = buf;
+                arg->stream_buf_size = buf_size;
+                arg->stream_ret = done;
+                arg->n_bases = 0;
+                buf_len = 0;
+            }
+            u.buf_offset = buf_len;
+            buf_len += scan_end - u.start;
+            if (buf_len > arg->stream_buf_size) {
+                arg->stream_buf_size = buf_len * 2;
+                if (!(arg->stream_buf = realloc(arg->stream_buf, arg->stream_buf_size))) fatal("Memory allocation failed");
+            }
+            memcpy(arg->stream_buf + u.buf_offset, ks->seq.s + u.start, scan_end - u.start);
+            kv_push(struct scan_unit, arg->units, u);
+            arg->n_bases += u.end - u.start;
+            if (arg->n_bases >= window) {
+                if (sorted) dispatch_par_arg_sorted(p, q, search_stream_par, arg);
+                else dispatch_par_arg(p, q, search_stream_par, arg);
+                arg = NULL;
+                n_jobs++;
+            }
+        } while (start < length);
+    }
+    if (ret < -1) fatalf("Error: truncated record in %s\n", path);
+    if (arg) {
+        if (sorted) dispatch_par_arg_sorted(p, q, search_stream_par, arg);
+        else dispatch_par_arg(p, q, search_stream_par, arg);
+        n_jobs++;
+    }
+    kseq_destroy(ks);
+    gzclose(fp);
+    free_stream_jobs(free_args);
+    return n_jobs;
+}
+
+/* Name of motif m in the count tables */
+static const char *motif_name(const char *motif, const pwmVec *pwms, int m)
+{
+    return motif ? motif : kv_A(*pwms, m)->name;
 }
 
+/* --count: one row per chromosome and motif, in file order */
+static void print_counts(const uint64_t *counts, FastaIndexEntry **entries, int n_entries,
+                         const char *motif, const pwmVec *pwms, int n_motifs)
+{
+    printf("#chrom\tmotif\tplus\tminus\ttotal\n");
+    for (int e = 0; e < n_entries; ++e) {
+        for (int m = 0; m < n_motifs; ++m) {
+            const uint64_t *c = counts + ((size_t)e * n_motifs + m) * 2;
+            printf("%s\t%s\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\n", entries[e]->name, motif_name(motif, pwms, m),
+                   c[0], c[1], c[0] + c[1]);
+        }
+    }
+}
+
+static void print_json_string(const char *s)
+{
+    putchar('"');
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20) printf("\\u%04x", *s);
+        else putchar(*s);
+    }
+    putchar('"');
+}
+
+/* --summary: the totals per chromosome, per motif and strand, and of the run */
+static void print_summary(const uint64_t *counts, FastaIndexEntry **entries, int n_entries,
+                          const char *motif, const pwmVec *pwms, int n_motifs)
+{
+    uint64_t *motif_total = calloc((size_t)n_motifs * 2, sizeof(uint64_t)), total = 0;
+    printf("{\n  \"chromosomes\": {");
+    for (int e = 0; e < n_entries; ++e) {
+        uint64_t n = 0;
+        for (int m = 0; m < n_motifs; ++m) {
+            const uint64_t *c = counts + ((size_t)e * n_motifs + m) * 2;
+            motif_total[m * 2] += c[0];
+            motif_total[m * 2 + 1] += c[1];
+            n += c[0] + c[1];
+        }
+        total += n;
+        printf("%s\n    ", e ? "," : "");
+        print_json_string(entries[e]->name);
+        printf(": %" PRIu64, n);
+    }
+    printf("\n  },\n  \"motifs\": {");
+    for (int m = 0; m < n_motifs; ++m) {
+        printf("%s\n    ", m ? "," : "");
+        print_json_string(motif_name(motif, pwms, m));
+        printf(": {\"plus\": %" PRIu64 ", \"minus\": %" PRIu64 ", \"total\": %" PRIu64 "}",
+               motif_total[m * 2], motif_total[m * 2 + 1], motif_total[m * 2] + motif_total[m * 2 + 1]);
+    }
+    printf("\n  },\n  \"total\": %" PRIu64 "\n}\n", total);
+    free(motif_total);
+}
+
+/* bedGraph of the bins with hits, in file order; the last bin of an entry ends with it */
+static void print_bins(const uint32_t *bins, const uint64_t *bin_first, uint64_t bin_size,
+                       FastaIndexEntry **entries, int n_entries)
+{
+    for (int e = 0; e < n_entries; ++e) {
+        uint64_t length = entries[e]->length;
+        const uint32_t *row = bins + bin_first[e];
+        for (uint64_t b = 0; b * bin_size < length; ++b) {
+            if (!row[b]) continue;
+            uint64_t end = (b + 1) * bin_size < length ? (b + 1) * bin_size : length;
+            printf("%s\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu32 "\n", entries[e]->name, b * bin_size, end, row[b]);
+        }
+    }
+}
 
 int main(int argc, char const *argv[])
 {
-    static bool verbose_flag;
+    static int verbose_flag;
+    static int populate_flag, hugepage_flag, fault_flag, steal_flag, sorted_flag, count_flag, summary_flag, stream_flag;
     int n_threads = 0;
     char *file_path = NULL;
+    char *out_path = NULL;
+    char *regions_path = NULL;
+    regionVec regions;
+    size_t n_targeted = 0;
+    int out_fd = -1, spill_fd = -1;
+    uint64_t spill_end = 0;
     char *motif = NULL;
-    FastaIndex *fi;
+    char *pwm_path = NULL;
+    bool pwm_library = false;
+    int engine = ENGINE_AUTO;
+    char *kernel = "auto";
+    int mismatches = 0;
+    int edits = 0;
+    uint64_t window = 0;
+    uint64_t bin_size = 0;
+    myers_t myers;
+    aho_motif_t aho;
+    bitap_t bitap;
+    dfa_t dfa;
+    scan_motif_t scan;
+    pwmVec pwms;
+    FastaIndex *fi = NULL;
     int c;
-    pthread_mutexattr_t attr;
-    pthread_mutexattr_init(&attr);
-    pthread_mutex_t pt_mu;
-    pthread_mutex_init(&pt_mu, &attr);
 
     while (1)
     {
@@ -50,17 +350,35 @@ int main(int argc, char const *argv[])
                 /* These options set a flag. */
                 {"verbose", no_argument, &verbose_flag, 1},
                 {"brief", no_argument, &verbose_flag, 0},
+                {"populate", no_argument, &populate_flag, 1},
+                {"hugepages", no_argument, &hugepage_flag, 1},
+                {"page-faults", no_argument, &fault_flag, 1},
+                {"work-stealing", no_argument, &steal_flag, 1},
+                {"sorted", no_argument, &sorted_flag, 1},
+                {"count", no_argument, &count_flag, 1},
+                {"summary", no_argument, &summary_flag, 1},
+                {"stream", no_argument, &stream_flag, 1},
                 /* These options don’t set a flag.
              We distinguish them by their indices. */
                 {"fasta", required_argument, 0, 'f'},
                 {"motif", required_argument, 0, 'm'},
                 {"nthreads", optional_argument, 0, 'p'},
+                {"engine", required_argument, 0, 'e'},
+                {"kernel", required_argument, 0, 'k'},
+                {"mismatches", required_argument, 0, 'x'},
+                {"edits", required_argument, 0, 'd'},
+                {"pwm", required_argument, 0, 'w'},
+                {"library", required_argument, 0, 'M'},
                 {"help", no_argument, NULL, 'h'},
                 {"version", no_argument, NULL, 'v'},
+                {"window", required_argument, 0, 'W'},
+                {"bin-size", required_argument, 0, 'B'},
+                {"output", required_argument, 0, 'o'},
+                {"regions", required_argument, 0, 'R'},
                 {0, 0, 0, 0}};
         /* getopt_long stores the option index here. */
         int option_index = 0;
-        c = getopt_long(argc, argv, "f:hm:p:v", long_options, &option_index);
+        c = getopt_long(argc, argv, "d:e:f:hk:m:M:o:p:R:vw:x:", long_options, &option_index);
 
         /* Detect the end of the options. */
         if (c == -1)
@@ -78,6 +396,14 @@ int main(int argc, char const *argv[])
             printf("\n");
             break;
 
+        case 'd':
+            edits = strtol(optarg, NULL, 10);
+            break;
+
+        case 'e':
+            engine = parse_engine(optarg);
+            break;
+
         case 'f':
             file_path = optarg;
             break;
@@ -86,10 +412,27 @@ int main(int argc, char const *argv[])
             usage();
             exit(0);
 
+        case 'k':
+            kernel = optarg;
+            break;
+
         case 'm':
             motif = optarg;
             break;
 
+        case 'M':
+            pwm_path = optarg;
+            pwm_library = true;
+            break;
+
+        case 'o':
+            out_path = optarg;
+            break;
+
+        case 'R':
+            regions_path = optarg;
+            break;
+
         case 'p':
             n_threads = MIN(strtol(optarg, NULL, 10), MAX_THREADS) ;
             break;
@@ -98,6 +441,24 @@ int main(int argc, char const *argv[])
             version();
             exit(0);
 
+        case 'w':
+            pwm_path = optarg;
+            break;
+
+        case 'x':
+            mismatches = strtol(optarg, NULL, 10);
+            break;
+
+        case 'W':
+            window = strtoull(optarg, NULL, 10);
+            if (window == 0) fatal("Error: --window must be a positive number of bases");
+            break;
+
+        case 'B':
+            bin_size = strtoull(optarg, NULL, 10);
+            if (bin_size == 0) fatal("Error: --bin-size must be a positive number of bases");
+            break;
+
         case '?':
             /* getopt_long already printed an error message. */
             break;
@@ -108,9 +469,60 @@ int main(int argc, char const *argv[])
     }
 
     n_threads = n_threads ? n_threads : MAX_THREADS;
+    /* stdin and pipes cannot be indexed nor mapped */
+    struct stat st;
+    if (file_path && (!strcmp(file_path, "-") || (stat(file_path, &st) == 0 && !S_ISREG(st.st_mode)))) stream_flag = 1;
+    if (stream_flag && (out_path || count_flag || summary_flag || bin_size || regions_path)) {
+        fatal("Error: streaming input is written to stdout, without -o/--output, --count, --summary, --bin-size or -R/--regions");
+    }
+    if ((count_flag || summary_flag || bin_size) && out_path) fatal("Error: --count, --summary and --bin-size print to stdout, not to -o/--output");
+    if (count_flag + summary_flag + (bin_size > 0) > 1) fatal("Error: --count, --summary and --bin-size are exclusive");
+    /* the file output is sorted by its own two passes, the counts have no order */
+    if (out_path || count_flag || summary_flag || bin_size) sorted_flag = 0;
     char *pattern[MAX_PATTERN_LEN];
+    int num = 0;
 
-    int num = parse_motif_pattern(motif, &pattern);
+    if (!file_path || !(motif || pwm_path)) {
+        usage();
+        exit(1);
+    }
+    if (motif && pwm_path) fatal("Error: -m/--motif, -w/--pwm and -M/--library are exclusive");
+    if (motif && strlen(motif) > MAX_MOTIF_LEN) fatalf("Error: motif longer than %d\n", MAX_MOTIF_LEN);
+    if (mismatches && edits) fatal("Error: -x/--mismatches and -d/--edits are exclusive");
+    if (engine == ENGINE_AUTO) {
+        if (pwm_path) engine = ENGINE_PWM;
+        else if (edits) engine = ENGINE_MYERS;
+        /* the automaton grows with the IUPAC expansion, the SIMD kernel does not */
+        else if (!mismatches && count_motif_patterns(motif) <= MAX_PATTERN_LEN) engine = ENGINE_DFA;
+        else engine = ENGINE_SIMD;
+    }
+    if ((engine == ENGINE_PWM) != (pwm_path != NULL)) fatal("Error: the pwm engine scans the motif file given by -w/--pwm or -M/--library");
+    if (mismatches && engine != ENGINE_SIMD) fatal("Error: -x/--mismatches needs the simd engine");
+    if (edits && engine != ENGINE_MYERS) fatal("Error: -d/--edits needs the myers engine");
+    if (engine == ENGINE_AHO || engine == ENGINE_DFA) {
+        /* Large IUPAC expansions would overflow the pattern array */
+        if (count_motif_patterns(motif) > MAX_PATTERN_LEN) fatalf("Error: motif expands to more than %d patterns, use -e bitap or -e simd\n", MAX_PATTERN_LEN);
+        num = parse_motif_pattern(motif, &pattern);
+        if (engine == ENGINE_DFA) dfa_init(&dfa, pattern, num);
+        else init_ahocorasick(&aho, pattern, num);
+    } else if (engine == ENGINE_BITAP) {
+        bitap_init(&bitap, motif);
+    } else if (engine == ENGINE_MYERS) {
+        myers_init(&myers, motif, edits);
+    } else if (engine == ENGINE_PWM) {
+        kv_init(pwms);
+        if (pwm_read_homer(pwm_path, &pwms) == 0) fatalf("Error: no motif found in %s\n", pwm_path);
+        /* -w keeps the first motif of the file */
+        if (!pwm_library) {
+            while (kv_size(pwms) > 1) pwm_destroy(kv_pop(pwms));
+        }
+        scan_kernel_init(kernel);
+        fprintf(stderr, "[motifSearch] scanning kernel: %s\n", scan_kernel_name());
+    } else {
+        scan_motif_init(&scan, motif, mismatches);
+        scan_kernel_init(kernel);
+        fprintf(stderr, "[motifSearch] scanning kernel: %s\n", scan_kernel_name());
+    }
     
     /*
     printf("%d\n", strlen(motif));
@@ -120,51 +532,255 @@ int main(int argc, char const *argv[])
     */
 
     pthread_setconcurrency(2);
-    tpool_t *p = tpool_init(n_threads);
-    tpool_process_t *q = tpool_process_init(p, 16, true);
+    if (out_path) {
+        if ((out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) fatalf("Error: could not open %s\n", out_path);
+        /* the jobs spill their formatted hits next to the output, on the same file system, and the
+           second pass copies them into place; the spill is unlinked at once and goes with its fd */
+        size_t len = strlen(out_path) + sizeof(".XXXXXX");
+        char *spill_path = malloc(len);
+        if (!spill_path) fatal("Memory allocation failed");
+        snprintf(spill_path, len, "%s.XXXXXX", out_path);
+        if ((spill_fd = mkstemp(spill_path)) < 0) fatalf("Error: could not create a temporary file next to %s\n", out_path);
+        unlink(spill_path);
+        free(spill_path);
+        output_init(-1, true);
+    } else {
+        /* the hits are written with write(2) by the output thread, after anything printed so far */
+        fflush(stdout);
+        output_init(STDOUT_FILENO, sorted_flag);
+    }
+    tpool_t *p = steal_flag ? tpool_init_ws(n_threads) : tpool_init(n_threads);
+    /* sorted output keeps the results, with room for a few per thread while an earlier job runs */
+    tpool_process_t *q = sorted_flag ? tpool_process_init(p, 16 + 2 * n_threads, false) : tpool_process_init(p, 16, true);
 
-    char *index_file_path = malloc(strlen(file_path)+4);
-    strcpy(index_file_path, file_path);
-    strcpy(index_file_path + strlen(file_path), ".fai");
+    struct fmm *fm = NULL;
+    if (!stream_flag) {
+        char *index_file_path = malloc(strlen(file_path) + 5);
+        strcpy(index_file_path, file_path);
+        strcpy(index_file_path + strlen(file_path), ".fai");
 
-    if (!(fi = readFastaIndex(index_file_path, 0))) {
-        printf("No index file found. Generating index file...\n");
-        fi = writeFastaIndex(file_path, 0, true);
+        if (!(fi = readFastaIndex(index_file_path, 0))) {
+            fprintf(stderr, "No index file found. Generating index file...\n");
+            fi = writeFastaIndex(file_path, 0, true);
+        }
+        /* mapped once, every job reads its entry from the same mapping */
+        fm = readFastaByMmap2(file_path, populate_flag, hugepage_flag);
+    }
+    /* hits starting in a window may end overlap bases past it */
+    int overlap = 0;
+    if (engine == ENGINE_PWM) {
+        for (size_t i = 0; i < kv_size(pwms); ++i) {
+            if (kv_A(pwms, i)->len - 1 > overlap) overlap = kv_A(pwms, i)->len - 1;
+            kv_A(pwms, i)->index = i;
+        }
+    } else {
+        overlap = strlen(motif) - 1;
+    }
+    if (regions_path) {
+        kv_init(regions);
+        if (regions_read_bed(regions_path, &regions) == 0) fatalf("Error: no interval found in %s\n", regions_path);
+        regions_merge(&regions);
     }
-    int num_chrom = kv_size(fi->sequence_names);
-    char *chrom_name;
+    /* the size of a stream is not known ahead */
+    if (!window && stream_flag) window = MIN_WINDOW;
+    if (!window) {
+        uint64_t total = 0;
+        FastaIndexEntry *e;
+        /* with -R the jobs only own the bases of the regions */
+        if (regions_path) for (size_t i = 0; i < kv_size(regions); ++i) total += kv_A(regions, i).end - kv_A(regions, i).start;
+        else if (fi) kh_foreach_value(fi->name_field, e, total += e->length);
+        window = n_threads > 1 ? total / (n_threads * WINDOWS_PER_THREAD) : total;
+        if (window < MIN_WINDOW) window = MIN_WINDOW;
+    }
+    if (sorted_flag && window > SORTED_WINDOW) window = SORTED_WINDOW;
+    /* whole bins per window: the bins of a window are only counted by its job, without atomics */
+    if (bin_size) window = (window + bin_size - 1) / bin_size * bin_size;
+    /* jobs follow the file order, so a batch of small entries reads one stretch of the mapping */
+    FastaIndexEntry **entries = NULL;
     FastaIndexEntry *entry;
-    kh_foreach(fi->name_field, chrom_name, entry, {
-            int blk;
-            struct par_arg *arg = malloc(sizeof(struct par_arg));
-            /* full header or not ?*/
-            if (chrom_name[strlen(chrom_name)-1] == '\n') {
-                chrom_name[strlen(chrom_name)-1] = '\0';
+    int n_entries = 0;
+    if (fi) {
+        entries = malloc(kh_size(fi->name_field) * sizeof(FastaIndexEntry *));
+        kh_foreach_value(fi->name_field, entry, entries[n_entries++] = entry);
+        qsort(entries, n_entries, sizeof(FastaIndexEntry *), cmp_entry_offset);
+    }
+    /* count modes: the hits are only counted, per entry, motif and strand */
+    int n_motifs = engine == ENGINE_PWM ? kv_size(pwms) : 1;
+    uint64_t *counts = NULL;
+    if (count_flag || summary_flag) {
+        if (!(counts = calloc((size_t)n_entries * n_motifs * 2, sizeof(uint64_t)))) fatal("Memory allocation failed");
+    }
+    /* bedGraph mode: one row of bins per entry, genome size / bin size counters in all */
+    uint32_t *bins = NULL;
+    uint64_t *bin_first = NULL;
+    if (bin_size) {
+        uint64_t n_bins = 0;
+        if (!(bin_first = malloc(n_entries * sizeof(uint64_t)))) fatal("Memory allocation failed");
+        for (int e = 0; e < n_entries; ++e) {
+            bin_first[e] = n_bins;
+            n_bins += ((uint64_t)entries[e]->length + bin_size - 1) / bin_size;
+        }
+        if (!(bins = calloc(n_bins ? n_bins : 1, sizeof(uint32_t)))) fatal("Memory allocation failed");
+    }
+
+    struct par_arg tmpl;
+    tmpl.file_path = file_path;
+    tmpl.fm = fm;
+    tmpl.stream_buf = NULL;
+    tmpl.stream_buf_size = 0;
+    tmpl.stream_ret = NULL;
+    tmpl.next = NULL;
+    tmpl.overlap = overlap;
+    tmpl.n_threads = n_threads;
+    tmpl.motif_len = motif ? strlen(motif) : 0;
+    tmpl.engine = engine;
+    tmpl.aho = &aho;
+    tmpl.bitap = &bitap;
+    tmpl.dfa = &dfa;
+    tmpl.scan = &scan;
+    tmpl.myers = &myers;
+    tmpl.pwms = pwm_path ? (const pwm_t *const *)pwms.a : NULL;
+    tmpl.n_pwms = pwm_path ? kv_size(pwms) : 0;
+    tmpl.out_fd = out_fd;
+    tmpl.spill_fd = spill_fd;
+    tmpl.spill_end = &spill_end;
+    tmpl.spill_offset = 0;
+    tmpl.out_bytes = 0;
+    tmpl.out_offset = 0;
+    tmpl.counts = counts;
+    tmpl.n_motifs = n_motifs;
+    tmpl.bins = bins;
+    tmpl.bin_first = bin_first;
+    tmpl.bin_size = bin_size;
+    /* windows of small entries or regions are packed into one job until it owns a window worth of bases;
+       the jobs are one slab, released after the flush */
+    kvec_t(struct par_arg) jobs;
+    kv_init(jobs);
+    struct par_arg arg;
+    bool job_open = false;
+    for (int e = 0; e < n_entries; ++e) {
+        entry = entries[e];
+        char *chrom_name = entry->name;
+        /* full header or not ?*/
+        if (chrom_name[strlen(chrom_name)-1] == '\n') {
+            chrom_name[strlen(chrom_name)-1] = '\0';
+        }
+        for (int i = 0; i < strlen(chrom_name); ++i) {
+            if (chrom_name[i] == ' ') {
+                chrom_name[i] = '\0';
             }
-            for (int i = 0; i < strlen(chrom_name); ++i) {
-                if (chrom_name[i] == ' ') {
-                    chrom_name[i] = '\0';
-                }
+        }
+        /* the spans scanned: the whole entry, or its target regions */
+        size_t first = 0, n_spans = 1;
+        if (regions_path) first = regions_find(&regions, chrom_name, &n_spans);
+        for (size_t r = 0; r < n_spans; ++r) {
+            uint64_t start = 0, span_end = entry->length;
+            struct region *g = NULL;
+            if (regions_path) {
+                g = &kv_A(regions, first + r);
+                start = g->start;
+                span_end = g->end < span_end ? g->end : span_end;
+                if (start >= span_end) continue;
+                n_targeted++;
             }
-            arg->chrom = chrom_name;
-
-            arg->file_path = file_path;
-            arg->entry = entry;
-            arg->n_patterns = num;
-            arg->pattern = pattern;
-            arg->pt_mu = &pt_mu;
-            arg->n_threads = n_threads;
-            arg->motif_len = strlen(motif);
             do {
-                blk = tpool_dispatch(p, q, search_fasta_par, (void *)arg, NULL, free_par_arg, true);
-                if (blk == -1) {
-                    usleep(10000);
+                struct scan_unit u;
+                u.chrom = chrom_name;
+                u.entry = entry;
+                u.idx = e;
+                u.start = start;
+                /* windows end on the grid of the chromosome; a run of edit distance ends may straddle a
+                   window boundary, myers keeps whole spans */
+                uint64_t next = engine == ENGINE_MYERS ? span_end : (start / window + 1) * window;
+                u.end = next < span_end ? next : span_end;
+                u.limit = span_end;
+                u.region = g;
+                start = u.end;
+                /* a full job is closed before the next unit, unless both count hits in the same bin */
+                if (job_open && arg.n_bases >= window) {
+                    const struct scan_unit *last = &kv_A(arg.units, kv_size(arg.units) - 1);
+                    if (!bin_size || last->entry != entry || u.start / bin_size != (last->end - 1) / bin_size) {
+                        kv_push(struct par_arg, jobs, arg);
+                        job_open = false;
+                    }
                 }
-            } while (blk == -1);
-    })
+                if (!job_open) {
+                    arg = tmpl;
+                    kv_init(arg.units);
+                    arg.n_bases = 0;
+                    job_open = true;
+                }
+                kv_push(struct scan_unit, arg.units, u);
+                arg.n_bases += u.end - u.start;
+            } while (start < span_end);
+        }
+    }
+    if (job_open) kv_push(struct par_arg, jobs, arg);
+    if (regions_path && n_targeted < kv_size(regions)) {
+        fprintf(stderr, "[motifSearch] %zu of %zu target regions are not on the FASTA entries, skipped\n",
+                kv_size(regions) - n_targeted, kv_size(regions));
+    }
+    /* LPT order: the short jobs left at the end fill in around the long ones; sorted output to stdout keeps file order */
+    if (!sorted_flag) qsort(jobs.a, kv_size(jobs), sizeof(struct par_arg), cmp_par_arg_bases);
+    long long t_start = tpool_now();
+    for (size_t i = 0; i < kv_size(jobs); ++i) {
+        if (sorted_flag) dispatch_par_arg_sorted(p, q, search_fasta_par, &kv_A(jobs, i));
+        else dispatch_par_arg(p, q, search_fasta_par, &kv_A(jobs, i));
+    }
+    /* streaming input: the jobs are made as the records come in, and released by themselves */
+    size_t n_jobs = kv_size(jobs);
+    entryVec records;
+    kv_init(records);
+    struct par_arg *stream_ret = NULL;
+    if (stream_flag) n_jobs = stream_jobs(p, q, &tmpl, file_path, window, sorted_flag, &records, &stream_ret);
 
     tpool_process_flush(q);
+    if (sorted_flag) send_results(q);
+    free_stream_jobs(stream_ret);
+    long long makespan = tpool_now() - t_start;
+    if (verbose_flag) {
+        fprintf(stderr, "[motifSearch] %zu jobs, makespan %.3f s\n", n_jobs, makespan / 1e6);
+        for (int i = 0; i < p->tsize; ++i) {
+            fprintf(stderr, "[motifSearch] thread %d: %d jobs, busy %.3f s, idle %.3f s\n", i, p->t[i].n_jobs,
+                    p->t[i].busy_time / 1e6, (makespan - p->t[i].busy_time) / 1e6);
+        }
+    }
+    if (out_fd >= 0) {
+        write_jobs(p, q, jobs.a, kv_size(jobs), out_fd);
+        if (close(out_fd) < 0) fatalf("Error: could not write %s\n", out_path);
+        close(spill_fd);
+        if (verbose_flag) fprintf(stderr, "[motifSearch] output written in %.3f s\n", (tpool_now() - t_start - makespan) / 1e6);
+    }
+    for (size_t i = 0; i < kv_size(jobs); ++i) free_par_arg(&kv_A(jobs, i));
+    kv_destroy(jobs);
     tpool_process_destroy(q);
     tpool_destroy(p);
+    output_finish();
+    if (count_flag) print_counts(counts, entries, n_entries, motif, &pwms, n_motifs);
+    if (summary_flag) print_summary(counts, entries, n_entries, motif, &pwms, n_motifs);
+    if (bin_size) print_bins(bins, bin_first, bin_size, entries, n_entries);
+    free(counts);
+    free(bins);
+    free(bin_first);
+    free(entries);
+    /* no job is left, release the mapping and the shared matchers */
+    if (fm) fastaMmapDestroy(fm);
+    for (size_t i = 0; i < kv_size(records); ++i) {
+        free(kv_A(records, i)->name);
+        fastaIndexEntryDestory(kv_A(records, i));
+    }
+    kv_destroy(records);
+    if (fault_flag) {
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        fprintf(stderr, "[motifSearch] page faults: %ld minor, %ld major\n", ru.ru_minflt, ru.ru_majflt);
+    }
+    if (regions_path) regions_destroy(&regions);
+    if (engine == ENGINE_AHO) destroy_ahocorasick(&aho);
+    if (engine == ENGINE_DFA) dfa_destroy(&dfa);
+    if (engine == ENGINE_PWM) {
+        for (size_t i = 0; i < kv_size(pwms); ++i) pwm_destroy(kv_A(pwms, i));
+        kv_destroy(pwms);
+    }
     pthread_exit(NULL);
 }
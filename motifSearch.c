@@ -107,6 +107,38 @@ char *reverseComplement(char *dna, long length)
     return new_dna;
 }
 
+/* IUPAC codes as 4-bit nucleotide sets: A=1, C=2, G=4, T=8 */
+static const uint8_t ntIupacMask[256] = {
+    ['A'] = 1, ['C'] = 2, ['G'] = 4, ['T'] = 8, ['U'] = 8,
+    ['R'] = 5, ['Y'] = 10, ['S'] = 6, ['W'] = 9, ['K'] = 12, ['M'] = 3,
+    ['B'] = 14, ['D'] = 13, ['H'] = 11, ['V'] = 7, ['N'] = 15, ['X'] = 15,
+    ['a'] = 1, ['c'] = 2, ['g'] = 4, ['t'] = 8, ['u'] = 8,
+    ['r'] = 5, ['y'] = 10, ['s'] = 6, ['w'] = 9, ['k'] = 12, ['m'] = 3,
+    ['b'] = 14, ['d'] = 13, ['h'] = 11, ['v'] = 7, ['n'] = 15, ['x'] = 15,
+};
+
+uint8_t iupac_to_mask(char c)
+{
+    return ntIupacMask[(unsigned char)c];
+}
+
+/* Sequence bytes only match as a single nucleotide; N and other codes match nothing */
+uint8_t nt_to_mask(char c)
+{
+    switch (c) {
+        case 'A': case 'a': return 1;
+        case 'C': case 'c': return 2;
+        case 'G': case 'g': return 4;
+        case 'T': case 't': return 8;
+        default: return 0;
+    }
+}
+
+uint8_t iupac_complement_mask(uint8_t mask)
+{
+    return ((mask & 1) << 3) | ((mask & 8) >> 3) | ((mask & 2) << 1) | ((mask & 4) >> 1);
+}
+
 /* A little array to help us decide if a character is a 
  * nucleotide, and if so convert it to lower case. */
 char ntChars[256];
@@ -164,83 +196,296 @@ void upper_str(char *__s, size_t __size)
     }
 }
 
+/* pos is relative to the window; hits starting in the overlap belong to the next window */
+static void print_hit(struct pt_info *t, int motif, const char *name, uint64_t pos, int len, char strand, double score)
+{
+    const char *region = NULL;
+    if (pos >= t->owned) return;
+    /* within merged regions, only the intervals around the hit label it; a hit across two is in neither */
+    if (t->region && !(region = regions_label(t->region, t->offset + pos, t->offset + pos + len))) return;
+    if (t->counts) {
+        t->counts[motif * 2 + (strand == '-')]++;
+        return;
+    }
+    if (t->bins) {
+        t->bins[(t->offset + pos) / t->bin_size]++;
+        return;
+    }
+    output_hit(t->chrom, t->rank, t->offset + pos, name, score, t->score_digits, strand, region, t->view, pos, len);
+}
+
+/* The hits go to the buffer of the worker, no callback takes a lock */
+struct aho_scan {
+	struct pt_info *t;
+	const uint8_t *strands;
+};
+
 void aho_callback(void *arg, struct aho_match_t *m)
+{
+	struct aho_scan *s = (struct aho_scan *) arg;
+	uint8_t strands = s->strands[m->id];
+	if (strands & DFA_FWD) print_hit(s->t, 0, ".", m->pos, s->t->motif_len, '+', 0);
+	if (strands & DFA_REV) print_hit(s->t, 0, ".", m->pos, s->t->motif_len, '-', 0);
+}
+
+void hit_callback(void *arg, uint64_t pos, char strand)
 {
 	struct pt_info *t = (struct pt_info *) arg;
-    while (pthread_mutex_trylock(t->mu) != 0);
-    char *s = calloc(t->motif_len+1, 1);
-    memcpy(s, t->seq + m->pos, t->motif_len);
-    if ((m->id % 2) == 0) printf("%s\t%llu\t%llu\t.\t.\t+\t%s\n", t->chrom, m->pos, m->pos + t->motif_len, s);
-    else printf("%s\t%llu\t%llu\t.\t.\t-\t%s\n", t->chrom, m->pos, m->pos + t->motif_len, s);
-    pthread_mutex_unlock(t->mu);
-    free(s);
+    print_hit(t, 0, ".", pos, t->motif_len, strand, 0);
 }
 
+void scan_callback(void *arg, uint64_t pos, char strand, int mismatches)
+{
+	struct pt_info *t = (struct pt_info *) arg;
+    print_hit(t, 0, ".", pos, t->motif_len, strand, mismatches);
+}
 
-void aho_callback_nolock(void *arg, struct aho_match_t *m)
+void myers_callback(void *arg, uint64_t start, uint64_t end, char strand, int edits)
 {
 	struct pt_info *t = (struct pt_info *) arg;
-    char *s = calloc(t->motif_len+1, 1);
-    memcpy(s, t->seq + m->pos, t->motif_len);
-    if ((m->id % 2) == 0) printf("%s\t%llu\t%llu\t.\t.\t+\t%s\n", t->chrom, m->pos, m->pos + t->motif_len, s);
-    else printf("%s\t%llu\t%llu\t.\t.\t-\t%s\n", t->chrom, m->pos, m->pos + t->motif_len, s);
-    free(s);
+    print_hit(t, 0, ".", start, end - start, strand, edits);
 }
 
-void search_motif(struct ahocorasick *aho, const char* seq, const char* chrom, int motif_len, bool uselock, pthread_mutex_t *mu)
+void pwm_callback(void *arg, const pwm_t *p, uint64_t pos, char strand, double score)
 {
-	struct pt_info *arg;
-	if (!(arg = malloc(sizeof(struct pt_info)))) {
-		fatal("Memory allocation failed");
-	}
-	arg->chrom = chrom;
-	arg->motif_len = motif_len;
-    arg->mu = mu;
-    arg->seq = seq;
-	if (uselock) aho_register_match_callback(aho, &aho_callback, (void *)arg);
-    else aho_register_match_callback(aho, &aho_callback_nolock, (void *)arg);
-	aho_findtext(aho, seq, strlen(seq));
+	struct pt_info *t = (struct pt_info *) arg;
+    print_hit(t, p->index, p->name, pos, p->len, strand, score);
 }
 
-void init_ahocorasick(struct ahocorasick *aho, const char** pattern, int n_patterns)
+/**
+ * @brief The trie is built once in main and shared by all the jobs.
+ * aho_findtext walks it without modifying it, only the callback lives in
+ * struct ahocorasick, so each job registers its own on a shallow copy.
+ */
+void search_motif(const aho_motif_t *aho, const char* seq, struct pt_info *t)
 {
-	aho_init(aho);
-    /** 
-    for (int i = 0; i < n_patterns; ++i)
-    {
-        printf("# Pattern: %s\n", pattern[i]);
-    }
-    **/
-      
-	for (int i = 0; i < n_patterns; i++)
+	struct ahocorasick local = aho->trie;
+	struct aho_scan s = { t, aho->strands };
+	t->score_digits = -1;
+	aho_register_match_callback(&local, &aho_callback, (void *)&s);
+	aho_findtext(&local, seq, t->view->length);
+}
+
+/* The search_motif_* functions scan t->view; t carries the chromosome and window of the job */
+void search_motif_bitap(const bitap_t *b, struct pt_info *t)
+{
+    t->motif_len = b->len;
+    t->score_digits = -1;
+    bitap_search(b, t->view, &hit_callback, (void *)t);
+}
+
+void search_motif_dfa(const dfa_t *d, struct pt_info *t)
+{
+    t->motif_len = d->len;
+    t->score_digits = -1;
+    dfa_search(d, t->view, &hit_callback, (void *)t);
+}
+
+void search_motif_simd(const scan_motif_t *m, struct pt_info *t)
+{
+    t->motif_len = m->len;
+    /* the mismatch count goes to the score column */
+    t->score_digits = m->max_mismatches > 0 ? 0 : -1;
+    scan_search(m, t->view, &scan_callback, (void *)t);
+}
+
+void search_motif_myers(const myers_t *my, struct pt_info *t)
+{
+    t->motif_len = my->len;
+    /* the edit distance goes to the score column */
+    t->score_digits = 0;
+    myers_search(my, t->view, &myers_callback, (void *)t);
+}
+
+void search_motif_pwm(const pwm_t *const *p, int n_pwm, struct pt_info *t)
+{
+    t->motif_len = 0; /* each hit carries its motif */
+    /* the log-odds score goes to the score column, the motif name to the name column */
+    t->score_digits = 3;
+    scan_pwm_search(p, n_pwm, t->view, &pwm_callback, (void *)t);
+}
+
+/* The patterns come in (forward, reverse complement) pairs, as parse_motif_pattern lists them */
+void init_ahocorasick(aho_motif_t *aho, const char** pattern, int n_patterns)
+{
+	int id[MAX_PATTERN_LEN];
+	aho_init(&aho->trie);
+	memset(aho->strands, 0, sizeof(aho->strands));
+	for (int i = 0; i < n_patterns && i < MAX_PATTERN_LEN; i++)
 	{
-		aho_add_match_text(aho, pattern[i], strlen(pattern[i]));
+		uint8_t strand = (i % 2) == 0 ? DFA_FWD : DFA_REV;
+		int j;
+		for (j = 0; j < i; j++)
+			if (strcmp(pattern[j], pattern[i]) == 0) break;
+		if (j < i) id[i] = id[j];
+		else id[i] = aho_add_match_text(&aho->trie, pattern[i], strlen(pattern[i]));
+		if (id[i] < 0 || id[i] >= MAX_PATTERN_LEN) fatalf("Error: cannot add pattern %s to the trie\n", pattern[i]);
+		aho->strands[id[i]] |= strand;
 	}
-       
-	aho_create_trie(aho);
+	aho_create_trie(&aho->trie);
+}
+
+void destroy_ahocorasick(aho_motif_t *aho)
+{
+	aho_destroy(&aho->trie);
+}
+
+/* Per-thread scratch, reused by the jobs a worker runs back to back */
+static __thread char *scratch;
+static __thread size_t scratch_size;
+
+static char *scratch_reserve(size_t size)
+{
+    if (size > scratch_size) {
+        free(scratch);
+        if (!(scratch = malloc(size))) fatal("Memory allocation failed");
+        scratch_size = size;
+    }
+    return scratch;
+}
+
+/* Per-thread counts of the unit being scanned, two strands per motif */
+static __thread uint64_t *unit_counts;
+static __thread int unit_counts_size;
+
+static void search_unit(const struct par_arg *parg, const struct scan_unit *u)
+{
+    FastaView chrom, view;
+    struct pt_info t;
+    int n_counts = parg->n_motifs * 2;
+    t.counts = NULL;
+    if (parg->counts) {
+        if (n_counts > unit_counts_size) {
+            free(unit_counts);
+            if (!(unit_counts = malloc(n_counts * sizeof(uint64_t)))) fatal("Memory allocation failed");
+            unit_counts_size = n_counts;
+        }
+        memset(unit_counts, 0, n_counts * sizeof(uint64_t));
+        t.counts = unit_counts;
+    }
+    /* the window reads overlap bases past its end to complete the hits starting in it, up to its limit */
+    uint64_t scan_end = u->end + parg->overlap < u->limit ? u->end + parg->overlap : u->limit;
+    if (parg->fm) {
+        fastaViewInit(&chrom, parg->fm, u->entry);
+        fastaViewSub(&chrom, u->start, scan_end - u->start, &view);
+    } else {
+        fastaViewFromBuffer(&view, parg->stream_buf + u->buf_offset, scan_end - u->start);
+    }
+    /* the windows are aligned on the bins, so a bin is only written by the job of its window */
+    t.bins = parg->bins ? parg->bins + parg->bin_first[u->idx] : NULL;
+    t.bin_size = parg->bin_size;
+    t.chrom = u->chrom;
+    t.region = u->region;
+    t.rank = u->entry->offset;
+    t.motif_len = parg->motif_len;
+    t.view = &view;
+    t.offset = u->start;
+    t.owned = u->end - u->start;
+    switch (parg->engine) {
+    case ENGINE_DFA:
+        search_motif_dfa(parg->dfa, &t);
+        break;
+    case ENGINE_BITAP:
+        search_motif_bitap(parg->bitap, &t);
+        break;
+    case ENGINE_MYERS:
+        search_motif_myers(parg->myers, &t);
+        break;
+    case ENGINE_PWM:
+        search_motif_pwm(parg->pwms, parg->n_pwms, &t);
+        break;
+    case ENGINE_SIMD:
+        search_motif_simd(parg->scan, &t);
+        break;
+    default: {
+        /* the trie of the submodule needs a contiguous upper case copy, made in one pass */
+        char *seq = scratch_reserve(view.length + 1);
+        fastaViewCopy(&view, 0, view.length, seq);
+        search_motif(parg->aho, seq, &t);
+    }
+    }
+    /* merged into the table of main once per unit, not per hit */
+    if (t.counts) {
+        uint64_t *row = parg->counts + (size_t)u->idx * n_counts;
+        for (int i = 0; i < n_counts; ++i) {
+            if (t.counts[i]) __atomic_add_fetch(&row[i], t.counts[i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Scan the units of the job, the hits go to the output buffers of the thread */
+static void scan_par_arg(const struct par_arg *parg)
+{
+    size_t n = kv_size(parg->units);
+    /* the genome is mapped once in main, only hint the stretches of the file read by this job:
+       the units of whole entries follow each other, target regions leave gaps that are not read */
+    const char *begin = NULL, *end = NULL;
+    for (size_t i = 0; i <= n && parg->fm; ++i) {
+        const char *b = NULL, *e = NULL;
+        if (i < n) {
+            const struct scan_unit *u = &kv_A(parg->units, i);
+            uint64_t scan_end = u->end + parg->overlap < u->limit ? u->end + parg->overlap : u->limit;
+            if (scan_end == u->start) continue; /* empty entry */
+            FastaView v;
+            fastaViewInit(&v, parg->fm, u->entry);
+            b = fastaViewAt(&v, u->start);
+            e = fastaViewAt(&v, scan_end - 1) + 1;
+            if (begin && b <= end + ADVISE_GAP) {
+                if (e > end) end = e;
+                continue;
+            }
+        }
+        if (begin) {
+            fastaMmapAdvise(parg->fm, begin, end, MADV_SEQUENTIAL);
+            fastaMmapAdvise(parg->fm, begin, end, MADV_WILLNEED);
+        }
+        begin = b;
+        end = e;
+    }
+    for (size_t i = 0; i < n; ++i) search_unit(parg, &kv_A(parg->units, i));
 }
 
-void search_fasta_par(void *arg)
+/* Returns the sorted hits of the job in sorted output to stdout, NULL otherwise */
+void *search_fasta_par(void *arg)
 {   
     struct par_arg *parg = (struct par_arg *)arg;
-    char** pattern = parg->pattern;
-    int n_patterns = parg->n_patterns;
-    int motif_len = parg->motif_len;
-    struct ahocorasick aho;
-    struct fmm *m = readFastaByMmap(parg->file_path);
-    char *seq = getFastaSequenceMmap2(m->mm, parg->entry);
-	init_ahocorasick(&aho, pattern, n_patterns);
-    upper_str(seq, strlen(seq));
-    if (parg->n_threads > 1) search_motif(&aho, seq, parg->chrom, motif_len, true, parg->pt_mu);
-    else search_motif(&aho, seq, parg->chrom, motif_len, false, NULL);
-    aho_destroy(&aho);
+    if (kv_size(parg->units) == 0) return NULL;
+    scan_par_arg(parg);
+    if (parg->out_fd < 0) return output_end_job();
+    /* first pass of the file output: the sorted hits are formatted once, to a slice of the spill,
+       and main places the slice in the file by its bytes */
+    output_buf_t *hits = output_end_job();
+    parg->out_bytes = output_length(hits);
+    parg->spill_offset = __atomic_fetch_add(parg->spill_end, parg->out_bytes, __ATOMIC_RELAXED);
+    output_pwrite(parg->spill_fd, hits, parg->spill_offset);
+    return NULL;
+}
+
+/* A streaming job pushes itself on the free list of the reader, the units and the buffer are reused by a later job */
+void *search_stream_par(void *arg)
+{
+    struct par_arg *parg = (struct par_arg *)arg;
+    struct par_arg **ret = parg->stream_ret;
+    void *hits = search_fasta_par(arg);
+    parg->next = __atomic_load_n(ret, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(ret, &parg->next, parg, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return hits;
+}
+
+/* Second pass of the file output: every job copies its slice of the spill to its place in the file */
+void *write_par_arg(void *arg)
+{
+    struct par_arg *parg = (struct par_arg *)arg;
+    output_copy(parg->spill_fd, parg->spill_offset, parg->out_fd, parg->out_offset, parg->out_bytes);
+    return NULL;
 }
 
 
+/* The jobs live in one array of main, only their units are released */
 void free_par_arg(void *arg)
 {
     struct par_arg *parg = (struct par_arg *)arg;
-    free(parg);
+    kv_destroy(parg->units);
 }
 
 char* parse_iupac(char c)
@@ -276,12 +521,36 @@ char* parse_iupac(char c)
 	return new_char;
 }
 
+/* Number of concrete patterns (both strands) the AC trie would need for this motif */
+uint64_t count_motif_patterns(const char* motif)
+{
+    uint64_t n = 2;
+    for (const char *c = motif; *c; ++c) {
+        n *= __builtin_popcount(iupac_to_mask(*c));
+        if (n > MAX_PATTERN_LEN) return MAX_PATTERN_LEN + 1;
+    }
+    return n;
+}
+
+int parse_engine(const char* name)
+{
+    if (strcmp(name, "auto") == 0) return ENGINE_AUTO;
+    if (strcmp(name, "aho") == 0) return ENGINE_AHO;
+    if (strcmp(name, "dfa") == 0) return ENGINE_DFA;
+    if (strcmp(name, "bitap") == 0) return ENGINE_BITAP;
+    if (strcmp(name, "simd") == 0) return ENGINE_SIMD;
+    if (strcmp(name, "myers") == 0) return ENGINE_MYERS;
+    if (strcmp(name, "pwm") == 0) return ENGINE_PWM;
+    fatalf("Error: unknown engine %s\n", name);
+}
+
 int parse_motif_pattern_help(char* motif, char** pattern, int* index)
 {
 	int ind = *index;
 	if (is_valid_dna(motif, strlen(motif))) {
 		bool exist = false;
-		for (int n = 0; n < ind; n++) {
+		// only forward patterns: a reverse complement may equal another expansion
+		for (int n = 0; n < ind; n += 2) {
 			if (strncmp(pattern[n], motif, strlen(motif)) == 0)
 			{
 				exist = true;
@@ -290,13 +559,13 @@ int parse_motif_pattern_help(char* motif, char** pattern, int* index)
 		// simple DNA motif, no ambiguity codes.
 		if (!exist) {
 			pattern[ind] = malloc(strlen(motif)+1);
-			memcpy(pattern[ind], motif, strlen(motif));
+			memcpy(pattern[ind], motif, strlen(motif)+1);
 			pattern[++ind] = reverseComplement(motif, strlen(motif));
 			*index = ind+1;
 		}
 	} else if (is_valid_ambiguity_codes(motif, strlen(motif))) {
 		char* tmp = malloc(strlen(motif)+1);
-		memcpy(tmp, motif, strlen(motif));
+		memcpy(tmp, motif, strlen(motif)+1);
 		for (int i = 0; i < strlen(motif); ++i) {
 			char* amb = parse_iupac(tmp[i]);
 			if (amb) {
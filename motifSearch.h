@@ -4,39 +4,129 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
-#include "kseq.h"
 #include "utils.h"
 #include "fasta.h"
+#include "bitap.h"
+#include "dfa.h"
+#include "scan_kernel.h"
+#include "myers.h"
+#include "pwm.h"
+#include "output.h"
+#include "regions.h"
 #include "./ahocorasick/include/ahocorasick.h"
 
 #define MAX_MOTIF_LEN 64
 #define MAX_PATTERN_LEN 512
+/* Units of a job closer than this in the file are advised as one stretch */
+#define ADVISE_GAP (64 << 10)
 
-KSEQ_INIT(FILE*, read)
+/* Matching engines, ENGINE_AUTO picks the flat DFA for exact motifs with few expansions */
+enum motif_engine {
+	ENGINE_AUTO = 0,
+	ENGINE_AHO,
+	ENGINE_BITAP,
+	ENGINE_SIMD,
+	ENGINE_MYERS,
+	ENGINE_PWM,
+	ENGINE_DFA,
+};
 
+/* Per-job match context handed to the engine callbacks */
 struct pt_info {
 	int motif_len;
 	char* chrom;
-	pthread_mutex_t *mu;
-	char *seq;
+	struct region *region; /* target region of the window, NULL without -R */
+	uint64_t rank;         /* file offset of the entry, orders the chromosomes in sorted output */
+	const FastaView *view; /* window being scanned, matched bases are copied from here */
+	uint64_t offset;       /* chromosome coordinate of the window */
+	uint64_t owned;        /* only hits starting before this belong to the window */
+	int score_digits; /* decimals of the score column, -1 prints "." */
+	uint64_t *counts;      /* hits of the window per motif and strand in count modes, NULL when hits are output */
+	uint32_t *bins;        /* hits per bin of the chromosome in bedGraph mode, NULL otherwise */
+	uint64_t bin_size;
 };
 
-struct par_arg {
+/* Window of one entry: the hits starting in [start, end) and ending before limit */
+struct scan_unit {
 	char* chrom;
-    char* file_path;
 	FastaIndexEntry *entry;
-	const char** pattern;
-	int n_patterns;
+	uint32_t idx; /* file order of the entry, its row in the count table */
+	uint64_t start;
+	uint64_t end;
+	uint64_t limit;     /* end of the entry, or of the target region */
+	struct region *region; /* target region, NULL without -R */
+	uint64_t buf_offset; /* streaming input: the bases of [start, limit or end + overlap) at stream_buf + buf_offset */
+};
+
+typedef kvec_t(struct scan_unit) scanUnitVec;
+
+/**
+ * @brief Trie of the distinct concrete patterns. The trie reports one match
+ * per text, so a palindrome or a reverse complement equal to another
+ * expansion is added once and the strands it stands for are OR'ed in
+ * strands, by id of the text, as the DFA does in its transitions.
+ */
+typedef struct aho_motif {
+	struct ahocorasick trie;
+	uint8_t strands[MAX_PATTERN_LEN]; /* DFA_FWD | DFA_REV */
+} aho_motif_t;
+
+struct par_arg {
+    char* file_path;
+	struct fmm *fm; /* shared mapping of file_path, NULL for streaming input */
+	char *stream_buf;      /* streaming input: copy of the bases of the units, kept for the next job */
+	size_t stream_buf_size;
+	struct par_arg **stream_ret; /* streaming input: the job returns itself here when done */
+	struct par_arg *next;        /* streaming input: link of the free lists */
+	scanUnitVec units;     /* scanned back to back, in file order */
+	uint64_t n_bases;      /* bases owned by the units */
+	int overlap;           /* bases read past each end, the longest hit minus one */
 	int motif_len;
-	pthread_mutex_t *pt_mu;
 	int n_threads;
+	int engine;
+	/* matchers built once in main, read-only in the jobs */
+	const aho_motif_t *aho;
+	const bitap_t *bitap;
+	const dfa_t *dfa;
+	const scan_motif_t *scan;
+	const myers_t *myers;
+	const pwm_t *const *pwms;
+	int n_pwms;
+	/* count modes: hits per entry, motif and strand, summed by all the jobs; NULL when hits are output */
+	uint64_t *counts;
+	int n_motifs;
+	/* bedGraph mode: hits per bin_size bases, the bins of entry idx start at bins + bin_first[idx]; NULL otherwise */
+	uint32_t *bins;
+	const uint64_t *bin_first;
+	uint64_t bin_size;
+	/* file output: the first pass spills the formatted hits at spill_offset of spill_fd, the second copies
+	   them to out_offset of out_fd (-1 for stdout); spill_end is the end of the spill, shared by the jobs */
+	int out_fd;
+	int spill_fd;
+	uint64_t *spill_end;
+	uint64_t spill_offset;
+	uint64_t out_bytes;
+	uint64_t out_offset;
 };
 
-void search_motif(struct ahocorasick *aho, const char* seq, const char* chrom, int motif_len, bool uselock, pthread_mutex_t *mu);
-void init_ahocorasick(struct ahocorasick *aho, const char** pattern, int n_patterns);
+void search_motif(const aho_motif_t *aho, const char* seq, struct pt_info *t);
+void init_ahocorasick(aho_motif_t *aho, const char** pattern, int n_patterns);
+void destroy_ahocorasick(aho_motif_t *aho);
 void search_fasta(const char** file_path, const char** pattern, int n_patterns, int motif_len);
 int parse_motif_pattern(char* motif, char** pattern);
-void search_fasta_par(void *arg);
+uint64_t count_motif_patterns(const char* motif);
+int parse_engine(const char* name);
+uint8_t iupac_to_mask(char c);
+uint8_t nt_to_mask(char c);
+uint8_t iupac_complement_mask(uint8_t mask);
+void search_motif_bitap(const bitap_t *b, struct pt_info *t);
+void search_motif_dfa(const dfa_t *d, struct pt_info *t);
+void search_motif_simd(const scan_motif_t *m, struct pt_info *t);
+void search_motif_myers(const myers_t *my, struct pt_info *t);
+void search_motif_pwm(const pwm_t *const *p, int n_pwm, struct pt_info *t);
+void *search_fasta_par(void *arg);
+void *search_stream_par(void *arg);
+void *write_par_arg(void *arg);
 void search_fasta_par_test(void *arg);
 void free_par_arg(void *arg);
 
@@ -0,0 +1,136 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "motifSearch.h"
+
+/* Throughput of the matching engines over a random sequence.
+ * Usage: motifSearch_bench [size in Mb] [motif] [HOMER motif file] */
+
+static uint64_t n_hits;
+
+static void bitap_count(void *arg, uint64_t pos, char strand) { n_hits++; }
+static void scan_count(void *arg, uint64_t pos, char strand, int mismatches) { n_hits++; }
+static void myers_count(void *arg, uint64_t start, uint64_t end, char strand, int edits) { n_hits++; }
+static void pwm_count(void *arg, const pwm_t *p, uint64_t pos, char strand, double score) { n_hits++; }
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double t, uint64_t len)
+{
+    printf("%-24s %9.1f ms %9.1f MB/s %6.2f ns/bp %12llu hits\n", name, t * 1e3, len / t / 1e6, t * 1e9 / len, (unsigned long long)n_hits);
+    n_hits = 0;
+}
+
+#define FORMAT_HITS 2000000
+
+/* BED lines per second, formatted as the old callbacks did and by the output thread */
+static void format_bench(const FastaView *view, const char *motif)
+{
+    int len = strlen(motif);
+    uint64_t step = (view->length - len) / FORMAT_HITS;
+    char *out = malloc((size_t)FORMAT_HITS * (len + 64));
+    struct output_hit h = {.chrom = "chr1", .name = ".", .len = len, .strand = '+', .score_digits = -1};
+    size_t n = 0;
+    double t = now();
+    for (uint64_t i = 0; i < FORMAT_HITS; ++i) {
+        char *s = calloc(len + 1, 1);
+        fastaViewCopy(view, i * step, len, s);
+        n += sprintf(out + n, "%s\t%llu\t%llu\t%s\t.\t%c\t%s\n", h.chrom, (unsigned long long)(i * step), (unsigned long long)(i * step + len), h.name, h.strand, s);
+        free(s);
+    }
+    t = now() - t;
+    printf("%-24s %9.1f ms %9.1f MB/s %6.2f ns/hit\n", "format printf", t * 1e3, n / t / 1e6, t * 1e9 / FORMAT_HITS);
+    struct output_fmt f = {0};
+    char bases[SCAN_MAX_LEN];
+    char *o = out;
+    t = now();
+    for (uint64_t i = 0; i < FORMAT_HITS; ++i) {
+        h.start = i * step;
+        fastaViewCopy(view, h.start, len, bases);
+        o = output_format_hit(o, &h, bases, &f);
+    }
+    t = now() - t;
+    printf("%-24s %9.1f ms %9.1f MB/s %6.2f ns/hit\n", "format output thread", t * 1e3, (o - out) / t / 1e6, t * 1e9 / FORMAT_HITS);
+    free(out);
+}
+
+int main(int argc, char const *argv[])
+{
+    uint64_t len = (argc > 1 ? strtoull(argv[1], NULL, 10) : 64) * 1000000;
+    const char *motif = argc > 2 ? argv[2] : "TGACTCAGA";
+    char *seq = malloc(len + 1);
+    char name[64];
+    double t;
+
+    srand(1);
+    for (uint64_t i = 0; i < len; ++i) seq[i] = "ACGT"[rand() & 3];
+    seq[len] = '\0';
+    FastaView view;
+    fastaViewFromBuffer(&view, seq, len);
+    scan_kernel_init("auto");
+    printf("# %llu bp, motif %s, kernel %s\n", (unsigned long long)len, motif, scan_kernel_name());
+
+    if (count_motif_patterns(motif) <= MAX_PATTERN_LEN) {
+        char *pattern[MAX_PATTERN_LEN], *m = strdup(motif);
+        int num = parse_motif_pattern(m, pattern);
+        dfa_t dfa;
+        dfa_init(&dfa, (const char **)pattern, num);
+        t = now();
+        dfa_search(&dfa, &view, bitap_count, NULL);
+        report("dfa exact", now() - t, len);
+        printf("# dfa: %d patterns, %u states, %zu bytes\n", num, dfa.n_states, dfa_memory(&dfa));
+        dfa_destroy(&dfa);
+        for (int i = 0; i < num; ++i) free(pattern[i]);
+        free(m);
+    }
+
+    bitap_t bitap;
+    bitap_init(&bitap, motif);
+    t = now();
+    bitap_search(&bitap, &view, bitap_count, NULL);
+    report("bitap exact", now() - t, len);
+
+    for (int k = 0; k <= 2; ++k) {
+        scan_motif_t scan;
+        scan_motif_init(&scan, motif, k);
+        t = now();
+        scan_search(&scan, &view, scan_count, NULL);
+        sprintf(name, "simd mismatches=%d", k);
+        report(name, now() - t, len);
+    }
+
+    for (int k = 0; k <= 2; ++k) {
+        myers_t myers;
+        myers_init(&myers, motif, k);
+        t = now();
+        myers_search(&myers, &view, myers_count, NULL);
+        sprintf(name, "myers edits=%d", k);
+        report(name, now() - t, len);
+    }
+
+    if (argc > 3) {
+        pwmVec pwms;
+        kv_init(pwms);
+        pwm_read_homer(argv[3], &pwms);
+        /* one pass per motif, against the whole library at once */
+        t = now();
+        for (size_t i = 0; i < kv_size(pwms); ++i) scan_pwm_search((const pwm_t *const *)&kv_A(pwms, i), 1, &view, pwm_count, NULL);
+        snprintf(name, sizeof(name), "pwm x%zu, one by one", kv_size(pwms));
+        report(name, now() - t, len);
+        t = now();
+        scan_pwm_search((const pwm_t *const *)pwms.a, kv_size(pwms), &view, pwm_count, NULL);
+        snprintf(name, sizeof(name), "pwm x%zu, library", kv_size(pwms));
+        report(name, now() - t, len);
+        for (size_t i = 0; i < kv_size(pwms); ++i) pwm_destroy(kv_A(pwms, i));
+        kv_destroy(pwms);
+    }
+    format_bench(&view, motif);
+    free(seq);
+    return 0;
+}
@@ -0,0 +1,617 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <math.h>
+#include "motifSearch.h"
+
+/* Hit sets of the engines over a generated FASTA, against a brute-force scan.
+ * Usage: motifSearch_test [bases per entry] [seed] */
+
+/* Grid of the planted sites: one straddles every multiple of SITE_STEP, at a
+   shift that walks the overlap of the windows cut on that grid */
+#define SITE_STEP 100
+/* Window sizes of the jobs, 0 scans whole entries */
+static const uint64_t windows[] = {0, SITE_STEP, 1000, 4096};
+#define N_WINDOWS (sizeof(windows) / sizeof(windows[0]))
+
+/* Entries of the generated FASTA, in file order, and their bases in one piece for the reference */
+#define N_ENTRIES 3
+static char fasta_path[] = "/tmp/motifSearch_test_XXXXXX";
+static struct fmm *fm;
+static FastaIndexEntry *entries[N_ENTRIES];
+static char *seqs[N_ENTRIES];
+static int n_failed;
+
+typedef kvec_t(char) text_t;
+
+static void text_printf(text_t *t, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (t->n + n + 1 > t->m) kv_resize(char, *t, (t->n + n + 1) * 2);
+    va_start(ap, fmt);
+    vsnprintf(t->a + t->n, n + 1, fmt, ap);
+    va_end(ap);
+    t->n += n;
+}
+
+static char complement(char c)
+{
+    switch (c) {
+        case 'A': return 'T';
+        case 'C': return 'G';
+        case 'G': return 'C';
+        case 'T': return 'A';
+        default: return 'N';
+    }
+}
+
+/* A concrete site of the IUPAC motif, on either strand */
+static void plant(char *s, const char *motif, int len)
+{
+    bool rev = rand() & 1;
+    for (int j = 0; j < len; ++j) {
+        uint8_t mask = iupac_to_mask(motif[j]);
+        int k;
+        do k = rand() & 3; while (!(mask & (1 << k)));
+        char c = "ACGT"[k];
+        if (rev) s[len - 1 - j] = complement(c);
+        else s[j] = c;
+    }
+}
+
+/**
+ * @brief Random bases with soft-masked stretches, runs of N and sites of
+ * the motifs straddling the window boundaries. The entries have different
+ * line widths, and the last one is shorter than the motifs.
+ */
+static void make_fasta(uint64_t size, const char *const *motifs, int n_motifs)
+{
+    static const char *names[N_ENTRIES] = {"t1", "t2", "t3"};
+    const uint64_t lengths[N_ENTRIES] = {size, size / 3 + 17, 5};
+    const int widths[N_ENTRIES] = {60, 71, 60};
+    int fd = mkstemp(fasta_path);
+    FILE *fp = fd < 0 ? NULL : fdopen(fd, "w");
+    if (!fp) fatal("Error: could not create the test FASTA");
+    for (int e = 0; e < N_ENTRIES; ++e) {
+        uint64_t len = lengths[e];
+        char *s = malloc(len + 1);
+        for (uint64_t i = 0; i < len; ++i) s[i] = "ACGT"[rand() & 3];
+        for (uint64_t i = 0, k = 0; i + SITE_STEP < len; i += SITE_STEP, ++k) {
+            const char *m = motifs[k % n_motifs];
+            int m_len = strlen(m), shift = k / n_motifs % m_len;
+            if (i + SITE_STEP - shift + m_len <= len) plant(s + i + SITE_STEP - shift, m, m_len);
+        }
+        for (uint64_t i = 3000; i + 500 < len; i += 7000) {
+            for (uint64_t j = i; j < i + 500; ++j) s[j] += 'a' - 'A';
+        }
+        for (uint64_t i = 5000; i + 30 < len; i += 11000) memset(s + i, 'N', 30);
+        s[len] = '\0';
+        fprintf(fp, ">%s\n", names[e]);
+        for (uint64_t i = 0; i < len; i += widths[e]) fprintf(fp, "%.*s\n", widths[e], s + i);
+        seqs[e] = s;
+    }
+    fclose(fp);
+    FastaIndex *fi = writeFastaIndex(fasta_path, 0, true);
+    for (int e = 0; e < N_ENTRIES; ++e) {
+        khint_t k = kh_get(str_hash_t, fi->name_field, names[e]);
+        if (k == kh_end(fi->name_field)) fatal("Error: entry missing from the test index");
+        entries[e] = (FastaIndexEntry *)kh_value(fi->name_field, k);
+    }
+    fm = readFastaByMmap2(fasta_path, false, false);
+}
+
+static void remove_fasta(void)
+{
+    char fai[sizeof(fasta_path) + 4];
+    sprintf(fai, "%s.fai", fasta_path);
+    unlink(fasta_path);
+    unlink(fai);
+    fastaMmapDestroy(fm);
+    for (int e = 0; e < N_ENTRIES; ++e) free(seqs[e]);
+}
+
+/**
+ * @brief Scan the FASTA with the engine of tmpl as main does: windows of
+ * the given size on the grid of each entry, packed into jobs in file
+ * order, the sorted hits of each job sent to the output thread in job
+ * order. Returns the BED text, in the order of --sorted.
+ */
+static text_t run_engine(const struct par_arg *tmpl, uint64_t window)
+{
+    FILE *fp = tmpfile();
+    text_t out;
+    kv_init(out);
+    if (!fp) fatal("Error: could not create the test output");
+    output_init(fileno(fp), true);
+    struct par_arg arg = *tmpl;
+    kv_init(arg.units);
+    arg.n_bases = 0;
+    for (int e = 0; e < N_ENTRIES; ++e) {
+        uint64_t start = 0, w = window ? window : entries[e]->length;
+        do {
+            struct scan_unit u = {.chrom = entries[e]->name, .entry = entries[e], .idx = e, .start = start};
+            uint64_t next = (start / w + 1) * w;
+            u.end = next < (uint64_t)entries[e]->length ? next : entries[e]->length;
+            u.limit = entries[e]->length;
+            start = u.end;
+            kv_push(struct scan_unit, arg.units, u);
+            arg.n_bases += u.end - u.start;
+            if (arg.n_bases >= w) {
+                output_send(search_fasta_par(&arg));
+                arg.units.n = 0;
+                arg.n_bases = 0;
+            }
+        } while (start < (uint64_t)entries[e]->length);
+    }
+    if (kv_size(arg.units)) output_send(search_fasta_par(&arg));
+    kv_destroy(arg.units);
+    output_finish();
+    rewind(fp);
+    char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        if (out.n + n + 1 > out.m) kv_resize(char, out, (out.n + n + 1) * 2);
+        memcpy(out.a + out.n, buf, n);
+        out.n += n;
+    }
+    if (out.n + 1 > out.m) kv_resize(char, out, out.n + 1);
+    out.a[out.n] = '\0';
+    fclose(fp);
+    return out;
+}
+
+/**
+ * @brief Sites within k mismatches of the IUPAC motif, position by
+ * position on both strands. N and the other codes of the sequence match
+ * nothing. The mismatches go to the score column when score is set.
+ */
+static text_t reference_iupac(const char *motif, int k, bool score)
+{
+    int len = strlen(motif);
+    uint8_t fwd[MAX_MOTIF_LEN], rev[MAX_MOTIF_LEN];
+    char bases[MAX_MOTIF_LEN + 1];
+    text_t ref;
+    kv_init(ref);
+    text_printf(&ref, "");
+    for (int j = 0; j < len; ++j) {
+        fwd[j] = iupac_to_mask(motif[j]);
+        rev[len - 1 - j] = iupac_complement_mask(fwd[j]);
+    }
+    for (int e = 0; e < N_ENTRIES; ++e) {
+        const char *s = seqs[e];
+        for (uint64_t i = 0; i + len <= (uint64_t)entries[e]->length; ++i) {
+            int mf = 0, mr = 0;
+            for (int j = 0; j < len; ++j) {
+                uint8_t b = nt_to_mask(s[i + j]);
+                mf += !(fwd[j] & b);
+                mr += !(rev[j] & b);
+                bases[j] = toupper(s[i + j]);
+            }
+            bases[len] = '\0';
+            for (int strand = 0; strand < 2; ++strand) {
+                int mm = strand ? mr : mf;
+                if (mm > k) continue;
+                if (score) text_printf(&ref, "%s\t%" PRIu64 "\t%" PRIu64 "\t.\t%d\t%c\t%s\n", entries[e]->name, i, i + len, mm, "+-"[strand], bases);
+                else text_printf(&ref, "%s\t%" PRIu64 "\t%" PRIu64 "\t.\t.\t%c\t%s\n", entries[e]->name, i, i + len, "+-"[strand], bases);
+            }
+        }
+    }
+    return ref;
+}
+
+static int count_lines(const char *s)
+{
+    int n = 0;
+    for (; *s; ++s) n += *s == '\n';
+    return n;
+}
+
+/* Compare the output of a run with the expected hits, showing the first line that differs */
+static void check(const char *what, uint64_t window, const text_t *got, const text_t *want)
+{
+    if (strcmp(got->a, want->a) == 0) {
+        printf("ok   %-32s window %-5" PRIu64 " %6d hits\n", what, window, count_lines(want->a));
+        return;
+    }
+    const char *g = got->a, *w = want->a;
+    while (*g && *g == *w) {
+        const char *eg = strchr(g, '\n'), *ew = strchr(w, '\n');
+        if (!eg || !ew || eg - g != ew - w || strncmp(g, w, eg - g)) break;
+        g = eg + 1;
+        w = ew + 1;
+    }
+    printf("FAIL %-32s window %-5" PRIu64 " %6d hits, expected %d\n", what, window, count_lines(got->a), count_lines(want->a));
+    printf("     got      %.*s\n", (int)strcspn(g, "\n"), *g ? g : "(end)");
+    printf("     expected %.*s\n", (int)strcspn(w, "\n"), *w ? w : "(end)");
+    n_failed++;
+}
+
+/* Run the engine of tmpl with every window size against want */
+static void check_windows(const char *what, const struct par_arg *tmpl, const text_t *want)
+{
+    for (size_t i = 0; i < N_WINDOWS; ++i) {
+        text_t got = run_engine(tmpl, windows[i]);
+        check(what, windows[i], &got, want);
+        kv_destroy(got);
+    }
+}
+
+static struct par_arg make_tmpl(int engine, const char *motif)
+{
+    struct par_arg tmpl;
+    memset(&tmpl, 0, sizeof(tmpl));
+    tmpl.file_path = fasta_path;
+    tmpl.fm = fm;
+    tmpl.engine = engine;
+    tmpl.n_threads = 1;
+    tmpl.motif_len = strlen(motif);
+    tmpl.overlap = tmpl.motif_len - 1;
+    tmpl.out_fd = -1;
+    return tmpl;
+}
+
+/* Exact IUPAC motifs: few and many expansions, a palindrome, Ns */
+static const char *exact_motifs[] = {"GATAAG", "TGASTCA", "GATATC", "WGATAR", "RYNNWSKMGG", "TTGACAGCTGTCAANNNNNNNNNNNNNNNNNNNNGCAT"};
+#define N_EXACT (sizeof(exact_motifs) / sizeof(exact_motifs[0]))
+
+static void check_bitap(void)
+{
+    char what[128];
+    for (size_t i = 0; i < N_EXACT; ++i) {
+        bitap_t b;
+        bitap_init(&b, exact_motifs[i]);
+        struct par_arg tmpl = make_tmpl(ENGINE_BITAP, exact_motifs[i]);
+        tmpl.bitap = &b;
+        text_t want = reference_iupac(exact_motifs[i], 0, false);
+        snprintf(what, sizeof(what), "bitap %s", exact_motifs[i]);
+        check_windows(what, &tmpl, &want);
+        kv_destroy(want);
+    }
+}
+
+/* Every variant compiled in, skipped when the CPU lacks it */
+static const char *kernels[] = {"avx512", "avx2", "sse42", "scalar"};
+#define N_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static void check_simd(void)
+{
+    char what[128];
+    for (size_t i = 0; i < N_EXACT; ++i) {
+        scan_motif_t m;
+        scan_motif_init(&m, exact_motifs[i], 0);
+        struct par_arg tmpl = make_tmpl(ENGINE_SIMD, exact_motifs[i]);
+        tmpl.scan = &m;
+        text_t want = reference_iupac(exact_motifs[i], 0, false);
+        for (size_t k = 0; k < N_KERNELS; ++k) {
+            if (!scan_kernel_supported(kernels[k])) continue;
+            scan_kernel_init(kernels[k]);
+            snprintf(what, sizeof(what), "simd/%s %s", kernels[k], exact_motifs[i]);
+            check_windows(what, &tmpl, &want);
+        }
+        kv_destroy(want);
+    }
+    scan_kernel_init("auto");
+}
+
+/* Hamming distance: motifs and the largest distance each is scanned with */
+static const struct {
+    const char *motif;
+    int k;
+} mm_motifs[] = {{"GATAAG", 2}, {"TGASTCA", 1}, {"RYNNWSKMGG", 2}, {"TTGACAGCTGTCAANNNNNNNNNNNNNNNNNNNNGCAT", 3}};
+#define N_MM (sizeof(mm_motifs) / sizeof(mm_motifs[0]))
+
+static void check_mismatches(void)
+{
+    char what[128];
+    for (size_t i = 0; i < N_MM; ++i) {
+        for (int k = 1; k <= mm_motifs[i].k; ++k) {
+            scan_motif_t m;
+            scan_motif_init(&m, mm_motifs[i].motif, k);
+            struct par_arg tmpl = make_tmpl(ENGINE_SIMD, mm_motifs[i].motif);
+            tmpl.scan = &m;
+            text_t want = reference_iupac(mm_motifs[i].motif, k, true);
+            for (size_t v = 0; v < N_KERNELS; ++v) {
+                if (!scan_kernel_supported(kernels[v])) continue;
+                scan_kernel_init(kernels[v]);
+                snprintf(what, sizeof(what), "simd/%s -x %d %s", kernels[v], k, mm_motifs[i].motif);
+                check_windows(what, &tmpl, &want);
+            }
+            kv_destroy(want);
+        }
+    }
+    scan_kernel_init("auto");
+}
+
+struct ref_hit {
+    uint64_t start, end;
+    char strand;
+    const char *name;
+    double score;
+};
+
+typedef kvec_t(struct ref_hit) refHitVec;
+
+/* The order of --sorted within an entry */
+static int cmp_ref_hit(const void *a, const void *b)
+{
+    const struct ref_hit *x = (const struct ref_hit *)a, *y = (const struct ref_hit *)b;
+    if (x->start != y->start) return x->start < y->start ? -1 : 1;
+    if (x->end - x->start != y->end - y->start) return x->end - x->start < y->end - y->start ? -1 : 1;
+    if (x->strand != y->strand) return x->strand < y->strand ? -1 : 1;
+    int c = strcmp(x->name, y->name);
+    if (c) return c;
+    return (x->score > y->score) - (x->score < y->score);
+}
+
+/* Sort the hits of entry e and append their BED lines, the score with the given decimals */
+static void format_ref_hits(text_t *ref, int e, refHitVec *hits, int score_digits)
+{
+    qsort(hits->a, kv_size(*hits), sizeof(struct ref_hit), cmp_ref_hit);
+    for (size_t i = 0; i < kv_size(*hits); ++i) {
+        const struct ref_hit *h = &kv_A(*hits, i);
+        char bases[MAX_MOTIF_LEN * 2 + 1];
+        for (uint64_t j = h->start; j < h->end; ++j) bases[j - h->start] = toupper(seqs[e][j]);
+        bases[h->end - h->start] = '\0';
+        text_printf(ref, "%s\t%" PRIu64 "\t%" PRIu64 "\t%s\t%.*f\t%c\t%s\n", entries[e]->name, h->start, h->end,
+                    h->name, score_digits, h->score, h->strand, bases);
+    }
+}
+
+/* Edit distance between the motif masks and the n bases at s */
+static int edit_distance(const uint8_t *mask, int len, const char *s, int n)
+{
+    int D[MAX_MOTIF_LEN + 1][MAX_MOTIF_LEN * 2 + 1];
+    for (int i = 0; i <= len; ++i) D[i][0] = i;
+    for (int t = 0; t <= n; ++t) D[0][t] = t;
+    for (int i = 1; i <= len; ++i) {
+        for (int t = 1; t <= n; ++t) {
+            int best = D[i - 1][t - 1] + !(mask[i - 1] & nt_to_mask(s[t - 1]));
+            if (D[i - 1][t] + 1 < best) best = D[i - 1][t] + 1;
+            if (D[i][t - 1] + 1 < best) best = D[i][t - 1] + 1;
+            D[i][t] = best;
+        }
+    }
+    return D[len][n];
+}
+
+/**
+ * @brief Sites within k edits, by Sellers' DP: the best distance of a
+ * span ending at each base, on both strands. A run of consecutive ends
+ * within k is one site, reported at its first best end with the shortest
+ * span reaching that distance.
+ */
+static text_t reference_edits(const char *motif, int k)
+{
+    int len = strlen(motif);
+    uint8_t masks[2][MAX_MOTIF_LEN];
+    int D[MAX_MOTIF_LEN + 1];
+    text_t ref;
+    kv_init(ref);
+    text_printf(&ref, "");
+    for (int j = 0; j < len; ++j) {
+        masks[0][j] = iupac_to_mask(motif[j]);
+        masks[1][len - 1 - j] = iupac_complement_mask(masks[0][j]);
+    }
+    for (int e = 0; e < N_ENTRIES; ++e) {
+        const char *s = seqs[e];
+        uint64_t n = entries[e]->length;
+        refHitVec hits;
+        kv_init(hits);
+        for (int strand = 0; strand < 2; ++strand) {
+            const uint8_t *mask = masks[strand];
+            bool in_run = false;
+            struct ref_hit h = {0, 0, "+-"[strand], ".", 0};
+            for (int i = 0; i <= len; ++i) D[i] = i;
+            for (uint64_t j = 0; j <= n; ++j) {
+                int score = k + 1;
+                if (j < n) {
+                    int diag = D[0];
+                    for (int i = 1; i <= len; ++i) {
+                        int best = diag + !(mask[i - 1] & nt_to_mask(s[j]));
+                        if (D[i] + 1 < best) best = D[i] + 1;
+                        if (D[i - 1] + 1 < best) best = D[i - 1] + 1;
+                        diag = D[i];
+                        D[i] = best;
+                    }
+                    score = D[len];
+                }
+                if (score <= k) {
+                    if (!in_run || score < h.score) {
+                        h.score = score;
+                        h.end = j + 1;
+                    }
+                    in_run = true;
+                } else if (in_run) {
+                    int span = 1;
+                    while (span > h.end || edit_distance(mask, len, s + h.end - span, span) > h.score) {
+                        if (++span > len + k) fatal("Error: no span for a reference site");
+                    }
+                    h.start = h.end - span;
+                    kv_push(struct ref_hit, hits, h);
+                    in_run = false;
+                }
+            }
+        }
+        format_ref_hits(&ref, e, &hits, 0);
+        kv_destroy(hits);
+    }
+    return ref;
+}
+
+/* Edit distance: whole entries only, as main keeps them for -d */
+static void check_edits(void)
+{
+    char what[128];
+    for (size_t i = 0; i < N_MM; ++i) {
+        for (int k = 0; k <= mm_motifs[i].k; ++k) {
+            myers_t my;
+            myers_init(&my, mm_motifs[i].motif, k);
+            struct par_arg tmpl = make_tmpl(ENGINE_MYERS, mm_motifs[i].motif);
+            tmpl.myers = &my;
+            text_t want = reference_edits(mm_motifs[i].motif, k), got = run_engine(&tmpl, 0);
+            snprintf(what, sizeof(what), "myers -d %d %s", k, mm_motifs[i].motif);
+            check(what, 0, &got, &want);
+            kv_destroy(got);
+            kv_destroy(want);
+        }
+    }
+}
+
+/* HOMER library of the PWM checks, drawn around IUPAC consensuses: name, consensus, threshold as a share of the best score */
+static const struct {
+    const char *name, *consensus;
+    double share;
+} pwm_motifs[] = {{"GATA1", "GATAAG", 0.6}, {"AP1", "TGASTCA", 0.5}, {"MIX", "RYNNWSKMGG", 0.4}};
+#define N_PWM (sizeof(pwm_motifs) / sizeof(pwm_motifs[0]))
+
+/* Random probabilities, higher on the bases of the consensus, so that the scores are spread finely around the thresholds */
+static void write_homer(const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp) fatal("Error: could not create the test motif file");
+    for (size_t i = 0; i < N_PWM; ++i) {
+        int len = strlen(pwm_motifs[i].consensus);
+        double prob[MAX_MOTIF_LEN][4], best = 0;
+        for (int j = 0; j < len; ++j) {
+            uint8_t mask = iupac_to_mask(pwm_motifs[i].consensus[j]);
+            double sum = 0, max = 0;
+            for (int b = 0; b < 4; ++b) {
+                prob[j][b] = mask & (1 << b) ? 1 + (rand() % 1000) / 500.0 : 0.05 + (rand() % 1000) / 4000.0;
+                sum += prob[j][b];
+            }
+            for (int b = 0; b < 4; ++b) {
+                prob[j][b] /= sum;
+                if (prob[j][b] > max) max = prob[j][b];
+            }
+            best += log(max / 0.25);
+        }
+        fprintf(fp, ">%s\t%s\t%.3f\n", pwm_motifs[i].consensus, pwm_motifs[i].name, best * pwm_motifs[i].share);
+        for (int j = 0; j < len; ++j) fprintf(fp, "%.4f\t%.4f\t%.4f\t%.4f\n", prob[j][0], prob[j][1], prob[j][2], prob[j][3]);
+    }
+    fclose(fp);
+}
+
+/* Windows scoring at least the threshold of each PWM, on both strands, scored by pwm_score */
+static text_t reference_pwm(const pwm_t *const *p, int n_pwm)
+{
+    text_t ref;
+    kv_init(ref);
+    text_printf(&ref, "");
+    for (int e = 0; e < N_ENTRIES; ++e) {
+        uint64_t n = entries[e]->length;
+        uint8_t *enc = malloc(n + 1);
+        for (uint64_t i = 0; i < n; ++i) enc[i] = nt_to_mask(seqs[e][i]);
+        refHitVec hits;
+        kv_init(hits);
+        for (int m = 0; m < n_pwm; ++m) {
+            for (uint64_t i = 0; i + p[m]->len <= n; ++i) {
+                for (int strand = 0; strand < 2; ++strand) {
+                    double score = pwm_score(p[m], enc + i, "+-"[strand]);
+                    if (score < p[m]->threshold) continue;
+                    struct ref_hit h = {i, i + p[m]->len, "+-"[strand], p[m]->name, score};
+                    kv_push(struct ref_hit, hits, h);
+                }
+            }
+        }
+        format_ref_hits(&ref, e, &hits, 3);
+        kv_destroy(hits);
+        free(enc);
+    }
+    return ref;
+}
+
+/* Each PWM alone as -w does, then the whole library in one pass as -M does */
+static void check_pwm(void)
+{
+    char path[] = "/tmp/motifSearch_test_XXXXXX", what[128];
+    int fd = mkstemp(path);
+    if (fd < 0) fatal("Error: could not create the test motif file");
+    close(fd);
+    write_homer(path);
+    pwmVec pwms;
+    kv_init(pwms);
+    pwm_read_homer(path, &pwms);
+    unlink(path);
+    int overlap = 0;
+    for (size_t i = 0; i < kv_size(pwms); ++i) {
+        kv_A(pwms, i)->index = i;
+        if (kv_A(pwms, i)->len - 1 > overlap) overlap = kv_A(pwms, i)->len - 1;
+    }
+    for (size_t i = 0; i <= kv_size(pwms); ++i) {
+        bool library = i == kv_size(pwms);
+        const pwm_t *const *p = library ? (const pwm_t *const *)pwms.a : (const pwm_t *const *)&kv_A(pwms, i);
+        int n_pwm = library ? kv_size(pwms) : 1;
+        struct par_arg tmpl = make_tmpl(ENGINE_PWM, "");
+        tmpl.pwms = p;
+        tmpl.n_pwms = n_pwm;
+        tmpl.n_motifs = n_pwm;
+        tmpl.overlap = library ? overlap : p[0]->len - 1;
+        text_t want = reference_pwm(p, n_pwm);
+        for (size_t k = 0; k < N_KERNELS; ++k) {
+            if (!scan_kernel_supported(kernels[k])) continue;
+            scan_kernel_init(kernels[k]);
+            snprintf(what, sizeof(what), "pwm/%s %s", kernels[k], library ? "library" : p[0]->name);
+            check_windows(what, &tmpl, &want);
+        }
+        kv_destroy(want);
+    }
+    scan_kernel_init("auto");
+    for (size_t i = 0; i < kv_size(pwms); ++i) pwm_destroy(kv_A(pwms, i));
+    kv_destroy(pwms);
+}
+
+/* The flat DFA and the trie it is compiled from, on the motifs whose expansion they accept */
+static void check_dfa(void)
+{
+    char what[128];
+    for (size_t i = 0; i < N_EXACT; ++i) {
+        if (count_motif_patterns(exact_motifs[i]) > MAX_PATTERN_LEN) continue;
+        char *pattern[MAX_PATTERN_LEN], *m = strdup(exact_motifs[i]);
+        int num = parse_motif_pattern(m, pattern);
+        dfa_t dfa;
+        aho_motif_t aho;
+        dfa_init(&dfa, (const char **)pattern, num);
+        init_ahocorasick(&aho, (const char **)pattern, num);
+        text_t want = reference_iupac(exact_motifs[i], 0, false);
+        struct par_arg tmpl = make_tmpl(ENGINE_DFA, exact_motifs[i]);
+        tmpl.dfa = &dfa;
+        snprintf(what, sizeof(what), "dfa %s", exact_motifs[i]);
+        check_windows(what, &tmpl, &want);
+        tmpl.engine = ENGINE_AHO;
+        tmpl.aho = &aho;
+        snprintf(what, sizeof(what), "aho %s", exact_motifs[i]);
+        check_windows(what, &tmpl, &want);
+        kv_destroy(want);
+        destroy_ahocorasick(&aho);
+        dfa_destroy(&dfa);
+        for (int j = 0; j < num; ++j) free(pattern[j]);
+        free(m);
+    }
+}
+
+int main(int argc, char const *argv[])
+{
+    uint64_t size = argc > 1 ? strtoull(argv[1], NULL, 10) : 60000;
+    srand(argc > 2 ? atoi(argv[2]) : 1);
+    make_fasta(size, exact_motifs, N_EXACT);
+    check_bitap();
+    check_simd();
+    check_mismatches();
+    check_edits();
+    check_pwm();
+    check_dfa();
+    remove_fasta();
+    if (n_failed) {
+        printf("%d checks failed\n", n_failed);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,129 @@
+// ****************************************
+// Myers' bit-vector edit-distance search
+// ----------------------------------------
+
+#include "myers.h"
+#include "motifSearch.h"
+
+/* Run of consecutive ends within max_edits, the best one is reported when it closes */
+struct myers_run {
+    bool in_run;
+    int best;
+    uint64_t best_end;
+};
+
+static void myers_strand_init(struct myers_strand *s, const uint8_t *mask, int len)
+{
+    memset(s, 0, sizeof(struct myers_strand));
+    for (int i = 0; i < len; ++i) {
+        s->mask[i] = mask[i];
+        for (int c = 0; c < 256; ++c) {
+            if (nt_to_mask(c) & mask[i]) s->peq[c] |= 1ULL << i;
+        }
+    }
+}
+
+void myers_init(myers_t *my, const char *motif, int max_edits)
+{
+    uint8_t fwd[MYERS_MAX_LEN], rev[MYERS_MAX_LEN];
+    int len = strlen(motif);
+    if (len == 0 || len > MYERS_MAX_LEN) fatalf("Error: motif length must be between 1 and %d\n", MYERS_MAX_LEN);
+    if (max_edits < 0 || max_edits >= len) fatal("Error: edit distance must be between 0 and motif length - 1");
+    for (int i = 0; i < len; ++i) {
+        fwd[i] = iupac_to_mask(motif[i]);
+        rev[i] = iupac_complement_mask(iupac_to_mask(motif[len - 1 - i]));
+    }
+    my->len = len;
+    my->max_edits = max_edits;
+    myers_strand_init(&my->fwd, fwd, len);
+    myers_strand_init(&my->rev, rev, len);
+}
+
+/**
+ * @brief Length of the shortest text span ending at end (inclusive) that
+ * aligns to the motif with the given number of edits. The bit-vectors
+ * only carry the end position, so this runs a small DP backwards over at
+ * most len + max_edits bases for each reported site.
+ */
+static int myers_span(const struct myers_strand *s, int len, int max_edits, const FastaView *v, uint64_t end, int edits)
+{
+    /* D[i]: distance between the last i motif positions and the last t bases */
+    int D[MYERS_MAX_LEN + 1];
+    for (int i = 0; i <= len; ++i) D[i] = i;
+    for (uint64_t t = 1; t <= (uint64_t)(len + max_edits) && t <= end + 1; ++t) {
+        uint8_t nt = nt_to_mask(*fastaViewAt(v, end + 1 - t));
+        int diag = D[0];
+        D[0] = t;
+        for (int i = 1; i <= len; ++i) {
+            int best = diag + !(s->mask[len - i] & nt);
+            if (D[i] + 1 < best) best = D[i] + 1;
+            if (D[i - 1] + 1 < best) best = D[i - 1] + 1;
+            diag = D[i];
+            D[i] = best;
+        }
+        if (D[len] <= edits) return t;
+    }
+    return len;
+}
+
+static void myers_report(const myers_t *my, const struct myers_strand *s, struct myers_run *run, const FastaView *v, char strand, myers_callback_t callback, void *arg)
+{
+    int span = myers_span(s, my->len, my->max_edits, v, run->best_end, run->best);
+    callback(arg, run->best_end + 1 - span, run->best_end + 1, strand, run->best);
+    run->in_run = false;
+}
+
+/**
+ * @brief One column of Myers' algorithm; the top row is free so matches
+ * may start anywhere. Returns the change of the last-row score.
+ */
+static inline int myers_step(uint64_t eq, uint64_t *pv, uint64_t *mv, uint64_t hb)
+{
+    uint64_t xv = eq | *mv;
+    uint64_t xh = (((eq & *pv) + *pv) ^ *pv) | eq;
+    uint64_t ph = *mv | ~(xh | *pv);
+    uint64_t mh = *pv & xh;
+    /* branch-free, the score moves randomly on non-matching sequence */
+    int delta = (int)((ph & hb) != 0) - (int)((mh & hb) != 0);
+    ph <<= 1;
+    mh <<= 1;
+    *pv = mh | ~(xv | ph);
+    *mv = ph & xv;
+    return delta;
+}
+
+/* Consecutive ends within max_edits describe the same site, keep the best one of each run */
+static void myers_track(const myers_t *my, const struct myers_strand *s, struct myers_run *run, int score, const FastaView *v, uint64_t j, char strand, myers_callback_t callback, void *arg)
+{
+    if (score <= my->max_edits) {
+        if (!run->in_run || score < run->best) {
+            run->best = score;
+            run->best_end = j;
+        }
+        run->in_run = true;
+    } else if (run->in_run) {
+        myers_report(my, s, run, v, strand, callback, arg);
+    }
+}
+
+void myers_search(const myers_t *my, const FastaView *v, myers_callback_t callback, void *arg)
+{
+    const uint64_t hb = 1ULL << (my->len - 1);
+    const int k = my->max_edits;
+    uint64_t fpv = ~0ULL, fmv = 0, rpv = ~0ULL, rmv = 0, n;
+    int fscore = my->len, rscore = my->len;
+    struct myers_run f = {false, 0, 0}, r = {false, 0, 0};
+    for (uint64_t pos = 0; pos < v->length; pos += n) {
+        const unsigned char *seq = (const unsigned char *)fastaViewSegment(v, pos, v->length, &n);
+        for (uint64_t i = 0; i < n; ++i) {
+            unsigned char c = seq[i];
+            uint64_t j = pos + i;
+            fscore += myers_step(my->fwd.peq[c], &fpv, &fmv, hb);
+            rscore += myers_step(my->rev.peq[c], &rpv, &rmv, hb);
+            if (unlikely(fscore <= k || f.in_run)) myers_track(my, &my->fwd, &f, fscore, v, j, '+', callback, arg);
+            if (unlikely(rscore <= k || r.in_run)) myers_track(my, &my->rev, &r, rscore, v, j, '-', callback, arg);
+        }
+    }
+    if (f.in_run) myers_report(my, &my->fwd, &f, v, '+', callback, arg);
+    if (r.in_run) myers_report(my, &my->rev, &r, v, '-', callback, arg);
+}
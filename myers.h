@@ -0,0 +1,33 @@
+// ****************************************
+// Myers' bit-vector edit-distance search
+// ----------------------------------------
+
+#ifndef _MYERS_H
+#define _MYERS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "fasta.h"
+
+#define MYERS_MAX_LEN 64
+
+/* start and end are 0-based, end exclusive, like a BED interval */
+typedef void (*myers_callback_t)(void *arg, uint64_t start, uint64_t end, char strand, int edits);
+
+/* Equality masks of one strand: bit i of peq[c] is set when the byte c matches motif position i */
+struct myers_strand {
+    uint64_t peq[256];
+    uint8_t mask[MYERS_MAX_LEN]; /* IUPAC nucleotide set of each position, for the traceback */
+};
+
+typedef struct myers {
+    int len;
+    int max_edits;
+    struct myers_strand fwd;
+    struct myers_strand rev; /* reverse complement of the motif */
+} myers_t;
+
+void myers_init(myers_t *my, const char *motif, int max_edits);
+void myers_search(const myers_t *my, const FastaView *v, myers_callback_t callback, void *arg);
+
+#endif
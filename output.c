@@ -0,0 +1,496 @@
+// ****************************************
+// Hit output: per-thread buffers and a writer thread
+// ----------------------------------------
+
+#include <pthread.h>
+#include <string.h>
+#include "output.h"
+#include "utils.h"
+
+/* Full buffers waiting for the writer, pushed by the workers */
+static output_buf_t *queue;
+/* Buffers written out, taken back by the workers in one exchange */
+static output_buf_t *spare;
+static output_buf_t *chain;
+
+static pthread_t writer;
+static pthread_mutex_t writer_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_c = PTHREAD_COND_INITIALIZER;
+static int writer_sleeping;
+/* Buffers queued and not yet formatted, and the workers waiting for the writer to take some */
+static int n_queued;
+static int senders_waiting;
+static pthread_cond_t space_c = PTHREAD_COND_INITIALIZER;
+static bool writer_done;
+static bool writer_started;
+static int out_fd;
+static bool ordered;
+
+static __thread output_buf_t *cur;
+static __thread output_buf_t *own_spare;
+/* Full buffers of the running job, in ordered mode */
+static __thread output_buf_t *job_head, *job_tail;
+
+/* Formatted bytes of a thread, allocated on its first write and released by output_finish */
+struct write_buf {
+    struct write_buf *chain;
+    char data[OUTPUT_WRITE_SIZE];
+};
+static struct write_buf *write_bufs;
+static __thread struct write_buf *own_write;
+
+/* Push-only stacks have no ABA, they are emptied with a single exchange */
+static void buf_push(output_buf_t **head, output_buf_t *b)
+{
+    b->next = __atomic_load_n(head, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(head, &b->next, b, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static output_buf_t *buf_get(void)
+{
+    if (!own_spare) own_spare = __atomic_exchange_n(&spare, NULL, __ATOMIC_ACQUIRE);
+    output_buf_t *b = own_spare;
+    if (b) {
+        own_spare = b->next;
+    } else {
+        if (!(b = malloc(sizeof(output_buf_t)))) fatal("Memory allocation failed");
+        b->chain = __atomic_load_n(&chain, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&chain, &b->chain, b, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    b->n_hits = 0;
+    b->n_bases = 0;
+    return b;
+}
+
+/**
+ * @brief The writer announces its sleep before the last look at the queue,
+ * so a push is never missed. Past OUTPUT_MAX_QUEUED buffers the sender
+ * waits for the writer, so a slow reader of the output holds back the
+ * workers instead of the hits piling up in memory.
+ */
+static void buf_send(output_buf_t *b)
+{
+    buf_push(&queue, b);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&writer_sleeping, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&writer_mu);
+        pthread_cond_signal(&writer_c);
+        pthread_mutex_unlock(&writer_mu);
+    }
+    if (__atomic_add_fetch(&n_queued, 1, __ATOMIC_SEQ_CST) > OUTPUT_MAX_QUEUED) {
+        pthread_mutex_lock(&writer_mu);
+        __atomic_add_fetch(&senders_waiting, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&n_queued, __ATOMIC_SEQ_CST) > OUTPUT_MAX_QUEUED) pthread_cond_wait(&space_c, &writer_mu);
+        __atomic_sub_fetch(&senders_waiting, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&writer_mu);
+    }
+}
+
+/* Writer side: a buffer is formatted, wake the senders once there is room */
+static void buf_done(output_buf_t *b)
+{
+    buf_push(&spare, b);
+    if (__atomic_sub_fetch(&n_queued, 1, __ATOMIC_SEQ_CST) <= OUTPUT_MAX_QUEUED &&
+        __atomic_load_n(&senders_waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&writer_mu);
+        pthread_cond_broadcast(&space_c);
+        pthread_mutex_unlock(&writer_mu);
+    }
+}
+
+void output_hit(const char *chrom, uint64_t rank, uint64_t start, const char *name, double score, int score_digits,
+                char strand, const char *region, const FastaView *v, uint64_t pos, int len)
+{
+    /* fastaViewCopy terminates the bases, which takes one more byte */
+    if (cur && (cur->n_hits == OUTPUT_BUF_HITS || cur->n_bases + len >= OUTPUT_BUF_BASES)) {
+        if (!ordered) {
+            buf_send(cur);
+        } else {
+            cur->next = NULL;
+            if (job_tail) job_tail->next = cur;
+            else job_head = cur;
+            job_tail = cur;
+        }
+        cur = NULL;
+    }
+    if (!cur) cur = buf_get();
+    struct output_hit *h = &cur->hit[cur->n_hits++];
+    h->chrom = chrom;
+    h->rank = rank;
+    h->name = name;
+    h->region = region;
+    h->start = start;
+    h->score = score;
+    h->bases = cur->n_bases;
+    h->len = len;
+    h->strand = strand;
+    h->score_digits = score_digits;
+    fastaViewCopy(v, pos, len, cur->base + cur->n_bases);
+    cur->n_bases += len;
+}
+
+static void output_flush_thread(void)
+{
+    if (cur && cur->n_hits) {
+        buf_send(cur);
+        cur = NULL;
+    }
+}
+
+struct hit_ref {
+    const output_buf_t *b;
+    const struct output_hit *h;
+};
+
+/* Chromosome then coordinate order; the remaining keys only make ties come out the same on every run */
+static int cmp_hit_ref(const void *a, const void *b)
+{
+    const struct output_hit *x = ((const struct hit_ref *)a)->h, *y = ((const struct hit_ref *)b)->h;
+    if (x->rank != y->rank) return x->rank < y->rank ? -1 : 1;
+    if (x->start != y->start) return x->start < y->start ? -1 : 1;
+    if (x->len != y->len) return x->len < y->len ? -1 : 1;
+    if (x->strand != y->strand) return x->strand < y->strand ? -1 : 1;
+    int c = strcmp(x->name, y->name);
+    if (c) return c;
+    return (x->score > y->score) - (x->score < y->score);
+}
+
+/* Sort the hits of the job into fresh buffers, the old ones go back to the spares of the thread */
+static output_buf_t *sort_job(output_buf_t *head)
+{
+    size_t n = 0, k = 0;
+    output_buf_t *b, *next, *out = NULL, *tail = NULL;
+    for (b = head; b; b = b->next) n += b->n_hits;
+    struct hit_ref *ref = malloc(n * sizeof(struct hit_ref));
+    if (!ref) fatal("Memory allocation failed");
+    for (b = head; b; b = b->next) {
+        for (int i = 0; i < b->n_hits; ++i) {
+            ref[k].b = b;
+            ref[k++].h = &b->hit[i];
+        }
+    }
+    qsort(ref, n, sizeof(struct hit_ref), cmp_hit_ref);
+    for (k = 0; k < n; ++k) {
+        const struct output_hit *h = ref[k].h;
+        if (!tail || tail->n_hits == OUTPUT_BUF_HITS || tail->n_bases + h->len > OUTPUT_BUF_BASES) {
+            b = buf_get();
+            b->next = NULL;
+            if (tail) tail->next = b;
+            else out = b;
+            tail = b;
+        }
+        struct output_hit *o = &tail->hit[tail->n_hits++];
+        *o = *h;
+        o->bases = tail->n_bases;
+        memcpy(tail->base + tail->n_bases, ref[k].b->base + h->bases, h->len);
+        tail->n_bases += h->len;
+    }
+    free(ref);
+    for (b = head; b; b = next) {
+        next = b->next;
+        b->next = own_spare;
+        own_spare = b;
+    }
+    return out;
+}
+
+output_buf_t *output_end_job(void)
+{
+    if (!ordered) {
+        output_flush_thread();
+        return NULL;
+    }
+    if (cur && cur->n_hits) {
+        cur->next = NULL;
+        if (job_tail) job_tail->next = cur;
+        else job_head = cur;
+        job_tail = cur;
+        cur = NULL;
+    }
+    output_buf_t *head = job_head;
+    job_head = job_tail = NULL;
+    return head ? sort_job(head) : NULL;
+}
+
+void output_send(output_buf_t *b)
+{
+    for (output_buf_t *next; b; b = next) {
+        next = b->next;
+        buf_send(b);
+    }
+}
+
+static void write_all(const char *s, size_t n)
+{
+    while (n) {
+        ssize_t w = write(out_fd, s, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            fatal("Error: could not write the output");
+        }
+        s += w;
+        n -= w;
+    }
+}
+
+static const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Two digits per division, written backwards into a scratch then copied in one go */
+static char *put_u64(char *o, uint64_t v)
+{
+    char tmp[20], *p = tmp + sizeof(tmp);
+    while (v >= 100) {
+        p -= 2;
+        memcpy(p, digit_pairs + (v % 100) * 2, 2);
+        v /= 100;
+    }
+    if (v >= 10) {
+        p -= 2;
+        memcpy(p, digit_pairs + v * 2, 2);
+    } else {
+        *--p = '0' + v;
+    }
+    size_t n = tmp + sizeof(tmp) - p;
+    memcpy(o, p, n);
+    return o + n;
+}
+
+static void measure_names(const struct output_hit *h, struct output_fmt *f)
+{
+    if (h->chrom != f->chrom) {
+        f->chrom = h->chrom;
+        f->chrom_len = strlen(h->chrom);
+    }
+    if (h->name != f->name) {
+        f->name = h->name;
+        f->name_len = strlen(h->name);
+    }
+    if (h->region != f->region) {
+        f->region = h->region;
+        f->region_len = h->region ? strlen(h->region) : 0;
+    }
+}
+
+char *output_format_hit(char *o, const struct output_hit *h, const char *bases, struct output_fmt *f)
+{
+    measure_names(h, f);
+    memcpy(o, f->chrom, f->chrom_len);
+    o += f->chrom_len;
+    *o++ = '\t';
+    o = put_u64(o, h->start);
+    *o++ = '\t';
+    o = put_u64(o, h->start + h->len);
+    *o++ = '\t';
+    memcpy(o, f->name, f->name_len);
+    o += f->name_len;
+    *o++ = '\t';
+    if (h->score_digits < 0) {
+        *o++ = '.';
+    } else if (h->score_digits == 0 && h->score >= 0 && h->score == (double)(uint64_t)h->score) {
+        /* mismatch and edit counts */
+        o = put_u64(o, (uint64_t)h->score);
+    } else {
+        /* PWM scores keep the rounding of printf */
+        o += sprintf(o, "%.*f", h->score_digits, h->score);
+    }
+    *o++ = '\t';
+    *o++ = h->strand;
+    *o++ = '\t';
+    memcpy(o, bases, h->len);
+    o += h->len;
+    if (h->region) {
+        *o++ = '\t';
+        memcpy(o, f->region, f->region_len);
+        o += f->region_len;
+    }
+    *o++ = '\n';
+    return o;
+}
+
+static int count_digits(uint64_t v)
+{
+    int n = 1;
+    while (v >= 100) {
+        n += 2;
+        v /= 100;
+    }
+    return n + (v >= 10);
+}
+
+/* Bytes of the BED line output_format_hit writes for h */
+static uint64_t hit_length(const struct output_hit *h, struct output_fmt *f)
+{
+    measure_names(h, f);
+    /* six tabs, the strand and the newline */
+    uint64_t n = f->chrom_len + f->name_len + h->len + 8;
+    if (h->region) n += f->region_len + 1;
+    n += count_digits(h->start) + count_digits(h->start + h->len);
+    if (h->score_digits < 0) n += 1;
+    else if (h->score_digits == 0 && h->score >= 0 && h->score == (double)(uint64_t)h->score) n += count_digits((uint64_t)h->score);
+    else n += snprintf(NULL, 0, "%.*f", h->score_digits, h->score);
+    return n;
+}
+
+uint64_t output_length(const output_buf_t *b)
+{
+    struct output_fmt f = {0};
+    uint64_t n = 0;
+    for (; b; b = b->next) {
+        for (int i = 0; i < b->n_hits; ++i) n += hit_length(&b->hit[i], &f);
+    }
+    return n;
+}
+
+static char *write_buf_get(void)
+{
+    if (!own_write) {
+        if (!(own_write = malloc(sizeof(struct write_buf)))) fatal("Memory allocation failed");
+        own_write->chain = __atomic_load_n(&write_bufs, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&write_bufs, &own_write->chain, own_write, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    return own_write->data;
+}
+
+static void pwrite_all(int fd, const char *s, size_t n, uint64_t offset)
+{
+    while (n) {
+        ssize_t w = pwrite(fd, s, n, offset);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            fatal("Error: could not write the output");
+        }
+        s += w;
+        n -= w;
+        offset += w;
+    }
+}
+
+uint64_t output_pwrite(int fd, output_buf_t *b, uint64_t offset)
+{
+    struct output_fmt f = {0};
+    size_t n = 0;
+    uint64_t total = 0;
+    output_buf_t *next;
+    char *slice = write_buf_get();
+    for (; b; b = next) {
+        next = b->next;
+        for (int i = 0; i < b->n_hits; ++i) {
+            const struct output_hit *h = &b->hit[i];
+            measure_names(h, &f);
+            if (n + f.chrom_len + f.name_len + f.region_len + h->len + 128 > OUTPUT_WRITE_SIZE) {
+                pwrite_all(fd, slice, n, offset + total);
+                total += n;
+                n = 0;
+            }
+            n = output_format_hit(slice + n, h, b->base + h->bases, &f) - slice;
+        }
+        b->next = own_spare;
+        own_spare = b;
+    }
+    pwrite_all(fd, slice, n, offset + total);
+    return total + n;
+}
+
+void output_copy(int from, uint64_t from_offset, int to, uint64_t to_offset, uint64_t n)
+{
+    char *buf = write_buf_get();
+    while (n) {
+        ssize_t r = pread(from, buf, n < OUTPUT_WRITE_SIZE ? n : OUTPUT_WRITE_SIZE, from_offset);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) fatal("Error: could not read back the hits");
+        pwrite_all(to, buf, r, to_offset);
+        from_offset += r;
+        to_offset += r;
+        n -= r;
+    }
+}
+
+static void format_buf(const output_buf_t *b, char *out, size_t *n, struct output_fmt *f)
+{
+    for (int i = 0; i < b->n_hits; ++i) {
+        const struct output_hit *h = &b->hit[i];
+        /* a BED line is the chromosome, the names, the bases and a few numbers */
+        measure_names(h, f);
+        if (*n + f->chrom_len + f->name_len + f->region_len + h->len + 128 > OUTPUT_WRITE_SIZE) {
+            write_all(out, *n);
+            *n = 0;
+        }
+        *n = output_format_hit(out + *n, h, b->base + h->bases, f) - out;
+    }
+}
+
+static void *output_writer(void *arg)
+{
+    (void)arg;
+    char *out = write_buf_get();
+    size_t n = 0;
+    struct output_fmt f = {0};
+    for (;;) {
+        output_buf_t *b = __atomic_exchange_n(&queue, NULL, __ATOMIC_ACQUIRE), *r = NULL, *next;
+        if (!b) {
+            /* nothing queued: write what is gathered, then sleep until a push or output_finish */
+            if (n) {
+                write_all(out, n);
+                n = 0;
+            }
+            pthread_mutex_lock(&writer_mu);
+            __atomic_store_n(&writer_sleeping, 1, __ATOMIC_SEQ_CST);
+            bool done = writer_done;
+            if (!done && !__atomic_load_n(&queue, __ATOMIC_SEQ_CST)) pthread_cond_wait(&writer_c, &writer_mu);
+            __atomic_store_n(&writer_sleeping, 0, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&writer_mu);
+            if (done && !__atomic_load_n(&queue, __ATOMIC_SEQ_CST)) break;
+            continue;
+        }
+        /* the stack holds the newest buffer first */
+        for (; b; b = next) {
+            next = b->next;
+            b->next = r;
+            r = b;
+        }
+        for (b = r; b; b = next) {
+            next = b->next;
+            format_buf(b, out, &n, &f);
+            buf_done(b);
+        }
+    }
+    return NULL;
+}
+
+void output_init(int fd, bool sorted)
+{
+    out_fd = fd;
+    ordered = sorted;
+    writer_done = false;
+    /* without fd the sorted hits of the jobs are collected for output_pwrite */
+    writer_started = fd >= 0;
+    if (writer_started && pthread_create(&writer, NULL, output_writer, NULL)) fatal("Error: could not start the output thread");
+}
+
+void output_finish(void)
+{
+    if (writer_started) {
+        output_flush_thread();
+        pthread_mutex_lock(&writer_mu);
+        writer_done = true;
+        pthread_cond_signal(&writer_c);
+        pthread_mutex_unlock(&writer_mu);
+        pthread_join(writer, NULL);
+    }
+    for (output_buf_t *b = chain, *next; b; b = next) {
+        next = b->chain;
+        free(b);
+    }
+    for (struct write_buf *w = write_bufs, *next; w; w = next) {
+        next = w->chain;
+        free(w);
+    }
+    queue = spare = chain = NULL;
+    write_bufs = NULL;
+    n_queued = 0;
+    own_spare = NULL;
+    own_write = NULL;
+}
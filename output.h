@@ -0,0 +1,88 @@
+// ****************************************
+// Hit output: per-thread buffers and a writer thread
+// ----------------------------------------
+
+#ifndef _OUTPUT_H
+#define _OUTPUT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "fasta.h"
+
+/* Records and matched bases per buffer, a worker hands a buffer over when either runs out */
+#define OUTPUT_BUF_HITS 4096
+#define OUTPUT_BUF_BASES (OUTPUT_BUF_HITS * 16)
+/* Full buffers waiting for the writer before the workers wait for it, about 20 MB */
+#define OUTPUT_MAX_QUEUED 64
+/* Formatted bytes the writer gathers before each write(2), and that any thread formats or copies at once */
+#define OUTPUT_WRITE_SIZE (1 << 20)
+
+/**
+ * @brief One hit, formatted by the writer as a BED line. chrom, name and
+ * region point to strings that outlive the run; the matched bases are
+ * stored in the arena of the buffer at bases.
+ */
+struct output_hit {
+    const char *chrom;
+    const char *name;
+    const char *region; /* id of the target region, a seventh column; NULL without -R */
+    uint64_t rank; /* orders the chromosomes, the file offset of the entry */
+    uint64_t start;
+    double score;
+    uint32_t bases;
+    uint16_t len;
+    char strand;
+    int8_t score_digits; /* decimals of the score column, -1 prints "." */
+};
+
+/**
+ * @brief Hits of one worker. A full buffer is pushed on the queue of the
+ * writer with a compare-and-swap and a new one is taken, so the workers
+ * only wait on the output once OUTPUT_MAX_QUEUED buffers are queued.
+ */
+typedef struct output_buf {
+    struct output_buf *next;  /* queue or free list */
+    struct output_buf *chain; /* every buffer ever allocated, released by output_finish */
+    int n_hits;
+    uint32_t n_bases;
+    struct output_hit hit[OUTPUT_BUF_HITS];
+    char base[OUTPUT_BUF_BASES];
+} output_buf_t;
+
+/* Lengths of the last chromosome, motif and region names, measured once per run of hits */
+struct output_fmt {
+    const char *chrom;
+    size_t chrom_len;
+    const char *name;
+    size_t name_len;
+    const char *region;
+    size_t region_len;
+};
+
+/* Start the writer thread on fd; sorted keeps the hits of each job for output_end_job.
+   With fd -1 there is no writer: the sorted hits of the jobs go to output_pwrite */
+void output_init(int fd, bool sorted);
+/* Append a hit to the buffer of the calling thread, the len bases at pos are copied from v */
+void output_hit(const char *chrom, uint64_t rank, uint64_t start, const char *name, double score, int score_digits,
+                char strand, const char *region, const FastaView *v, uint64_t pos, int len);
+/**
+ * @brief Called at the end of each job. Unsorted, the hits of the thread
+ * are handed to the writer and NULL is returned. Sorted, the hits of the
+ * job are returned in coordinate order, for the caller to pass to
+ * output_send in job order.
+ */
+output_buf_t *output_end_job(void);
+/* Queue a chain of buffers for the writer, in order; one thread only */
+void output_send(output_buf_t *b);
+/* Bytes of the BED lines of a chain of hits */
+uint64_t output_length(const output_buf_t *b);
+/* Format a chain of hits and write it at offset of fd, then recycle its buffers; returns the bytes written */
+uint64_t output_pwrite(int fd, output_buf_t *b, uint64_t offset);
+/* Copy n bytes at from_offset of from to to_offset of to, through the buffer of the thread */
+void output_copy(int from, uint64_t from_offset, int to, uint64_t to_offset, uint64_t n);
+/* Format h as a BED line at o, without printf; returns the end of the line */
+char *output_format_hit(char *o, const struct output_hit *h, const char *bases, struct output_fmt *f);
+/* Write every queued hit, stop the writer and release the buffers */
+void output_finish(void);
+
+#endif
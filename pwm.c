@@ -0,0 +1,119 @@
+// ****************************************
+// Position weight matrices (HOMER .motif)
+// ----------------------------------------
+
+#include <math.h>
+#include "pwm.h"
+#include "motifSearch.h"
+
+/* One-hot code of A, C, G, T, and the complement of each */
+static const int ntOneHotCode[4] = {1, 2, 4, 8};
+
+static pwm_t *pwm_init(const char *header)
+{
+    pwm_t *p = calloc(1, sizeof(pwm_t));
+    stringVec fields = split(header + 1, "\t");
+    if (kv_size(fields) < 3) fatalf("Error: malformed motif header %s\n", header);
+    p->consensus = strdup(kv_A(fields, 0));
+    p->name = strdup(kv_A(fields, 1));
+    p->threshold = strtod(kv_A(fields, 2), NULL);
+    free(kv_A(fields, 0));
+    kv_destroy(fields);
+    return p;
+}
+
+/* Fill the reverse strand, the N scores and the quantized tables once all rows are read */
+static void pwm_finish(pwm_t *p)
+{
+    double max_abs = 0;
+    if (p->len == 0) fatalf("Error: motif %s has no positions\n", p->name);
+    for (int j = 0; j < p->len; ++j) {
+        double worst = p->fwd[j][1];
+        for (int b = 0; b < 4; ++b) {
+            int c = ntOneHotCode[b];
+            if (p->fwd[j][c] < worst) worst = p->fwd[j][c];
+            p->rev[p->len - 1 - j][ntOneHotCode[3 - b]] = p->fwd[j][c];
+        }
+        p->fwd[j][0] = worst;
+        p->rev[p->len - 1 - j][0] = worst;
+        for (int b = 0; b < 4; ++b) {
+            if (fabs(p->fwd[j][ntOneHotCode[b]]) > max_abs) max_abs = fabs(p->fwd[j][ntOneHotCode[b]]);
+        }
+    }
+    p->scale = max_abs > 0 ? 127.0 / max_abs : 1.0;
+    for (int j = 0; j < p->len; ++j) {
+        for (int c = 0; c <= 8; ++c) {
+            double qf = ceil(p->fwd[j][c] * p->scale), qr = ceil(p->rev[j][c] * p->scale);
+            p->qfwd[j][c] = qf > 127 ? 127 : qf < -127 ? -127 : (int8_t)qf;
+            p->qrev[j][c] = qr > 127 ? 127 : qr < -127 ? -127 : (int8_t)qr;
+        }
+    }
+    /* one below the rounded threshold absorbs the floating point error of the products */
+    double qt = floor(p->threshold * p->scale) - 1;
+    p->qthreshold = qt < INT16_MIN + 1 ? INT16_MIN + 1 : qt > INT16_MAX ? INT16_MAX : (int16_t)qt;
+}
+
+int pwm_read_homer(const char *path, pwmVec *motifs)
+{
+    FILE *fp;
+    char *line = NULL;
+    size_t bufsize = 0;
+    pwm_t *p = NULL;
+    int n = 0;
+    if (!(fp = fopen(path, "r"))) fatalf("Error: could not open motif file %s\n", path);
+    while (getline(&line, &bufsize, fp) != -1) {
+        if (line[0] == '>') {
+            if (p) {
+                pwm_finish(p);
+                kv_push(pwm_t *, *motifs, p);
+                n++;
+            }
+            p = pwm_init(line);
+        } else if (p) {
+            double prob[4], sum = 0;
+            char *s = line, *end;
+            int b;
+            for (b = 0; b < 4; ++b) {
+                prob[b] = strtod(s, &end);
+                if (end == s) break;
+                sum += prob[b];
+                s = end;
+            }
+            if (b == 0) continue; /* blank line */
+            if (b < 4 || sum <= 0) fatalf("Error: malformed row in motif %s\n", p->name);
+            if (p->len == PWM_MAX_LEN) fatalf("Error: motif %s longer than %d\n", p->name, PWM_MAX_LEN);
+            for (b = 0; b < 4; ++b) {
+                double q = prob[b] / sum;
+                if (q < PWM_MIN_PROB) q = PWM_MIN_PROB;
+                p->fwd[p->len][ntOneHotCode[b]] = log(q / 0.25);
+            }
+            p->len++;
+        }
+    }
+    if (p) {
+        pwm_finish(p);
+        kv_push(pwm_t *, *motifs, p);
+        n++;
+    }
+    free(line);
+    fclose(fp);
+    return n;
+}
+
+void pwm_destroy(pwm_t *p)
+{
+    free(p->name);
+    free(p->consensus);
+    free(p);
+}
+
+double pwm_score(const pwm_t *p, const uint8_t *enc, char strand)
+{
+    double score = 0;
+    if (strand == '+') {
+        for (int j = 0; j < p->len; ++j) score += p->fwd[j][enc[j]];
+    } else {
+        for (int j = 0; j < p->len; ++j) score += p->rev[j][enc[j]];
+    }
+    return score;
+}
@@ -0,0 +1,48 @@
+// ****************************************
+// Position weight matrices (HOMER .motif)
+// ----------------------------------------
+
+#ifndef _PWM_H
+#define _PWM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "kvec.h"
+
+#define PWM_MAX_LEN 64
+/* Probabilities are floored before taking the log-odds */
+#define PWM_MIN_PROB 0.001
+
+typedef struct pwm pwm_t;
+/* p is the motif that matched, when a whole library is scanned at once */
+typedef void (*pwm_callback_t)(void *arg, const pwm_t *p, uint64_t pos, char strand, double score);
+
+/**
+ * @brief Log-odds matrix of a motif against a uniform background, for both
+ * strands. Tables are indexed by the one-hot encoded base of the scanning
+ * kernels (A=1, C=2, G=4, T=8, N=0); N scores as the worst base of the
+ * column. The int8 tables are rounded up so that their sum never falls
+ * below scale * score, which makes qthreshold a safe SIMD prefilter for
+ * the exact double-precision score.
+ */
+struct pwm {
+    char *name;
+    char *consensus;
+    int len;
+    int index; /* position in the library, the column of the count tables */
+    double threshold;
+    double fwd[PWM_MAX_LEN][16];
+    double rev[PWM_MAX_LEN][16];
+    int8_t qfwd[PWM_MAX_LEN][16];
+    int8_t qrev[PWM_MAX_LEN][16];
+    double scale;
+    int16_t qthreshold;
+};
+
+typedef kvec_t(pwm_t *) pwmVec;
+
+int pwm_read_homer(const char *path, pwmVec *motifs);
+void pwm_destroy(pwm_t *p);
+double pwm_score(const pwm_t *p, const uint8_t *enc, char strand);
+
+#endif
@@ -0,0 +1,143 @@
+// ****************************************
+// Target regions (BED), sorted and merged
+// ----------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "regions.h"
+#include "utils.h"
+
+int regions_read_bed(const char *path, regionVec *r)
+{
+    FILE *fp;
+    char *line = NULL;
+    size_t bufsize = 0;
+    int n = 0, lineno = 0;
+    if (!(fp = fopen(path, "r"))) fatalf("Error: could not open region file %s\n", path);
+    while (getline(&line, &bufsize, fp) != -1) {
+        lineno++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!line[0] || line[0] == '#' || !strncmp(line, "track", 5) || !strncmp(line, "browser", 7)) continue;
+        char *chrom = strtok(line, "\t"), *start = strtok(NULL, "\t"), *end = strtok(NULL, "\t"), *name = strtok(NULL, "\t");
+        char *s_end, *e_end;
+        struct region g;
+        if (!end) fatalf("Error: line %d of %s has less than three columns\n", lineno, path);
+        g.start = strtoull(start, &s_end, 10);
+        g.end = strtoull(end, &e_end, 10);
+        if (*s_end || *e_end || g.end < g.start) fatalf("Error: malformed interval on line %d of %s\n", lineno, path);
+        if (g.end == g.start) continue;
+        g.chrom = strdup(chrom);
+        if (name && strcmp(name, ".")) {
+            g.id = strdup(name);
+        } else {
+            g.id = malloc(strlen(chrom) + 42);
+            sprintf(g.id, "%s:%llu-%llu", chrom, (unsigned long long)g.start, (unsigned long long)g.end);
+        }
+        if (!g.chrom || !g.id) fatal("Memory allocation failed");
+        kv_init(g.parts);
+        kv_init(g.labels);
+        kv_push(struct region, *r, g);
+        n++;
+    }
+    free(line);
+    fclose(fp);
+    return n;
+}
+
+static int cmp_region(const void *a, const void *b)
+{
+    const struct region *x = (const struct region *)a, *y = (const struct region *)b;
+    int c = strcmp(x->chrom, y->chrom);
+    if (c) return c;
+    if (x->start != y->start) return x->start < y->start ? -1 : 1;
+    return (x->end > y->end) - (x->end < y->end);
+}
+
+void regions_merge(regionVec *r)
+{
+    size_t k = 0;
+    if (kv_size(*r) == 0) return;
+    qsort(r->a, kv_size(*r), sizeof(struct region), cmp_region);
+    for (size_t i = 1; i < kv_size(*r); ++i) {
+        struct region *last = &kv_A(*r, k), *g = &kv_A(*r, i);
+        if (!strcmp(last->chrom, g->chrom) && g->start < last->end) {
+            struct region_part part = {g->start, g->end, g->id};
+            if (last->id) {
+                struct region_part own = {last->start, last->end, last->id};
+                kv_push(struct region_part, last->parts, own);
+                last->id = NULL;
+            }
+            kv_push(struct region_part, last->parts, part);
+            if (g->end > last->end) last->end = g->end;
+            free(g->chrom);
+        } else {
+            kv_A(*r, ++k) = *g;
+        }
+    }
+    r->n = k + 1;
+}
+
+static pthread_mutex_t label_mu = PTHREAD_MUTEX_INITIALIZER;
+static __thread kvec_t(char) label_buf;
+static __thread const struct region *last_region;
+static __thread const char *last_label;
+
+const char *regions_label(struct region *g, uint64_t start, uint64_t end)
+{
+    if (g->id) return g->id;
+    label_buf.n = 0;
+    /* the parts are sorted by start, none past the hit can contain it */
+    for (size_t i = 0; i < kv_size(g->parts) && kv_A(g->parts, i).start <= start; ++i) {
+        const struct region_part *p = &kv_A(g->parts, i);
+        if (p->end < end) continue;
+        if (label_buf.n) kv_push(char, label_buf, ',');
+        for (const char *c = p->id; *c; ++c) kv_push(char, label_buf, *c);
+    }
+    if (!label_buf.n) return NULL;
+    kv_push(char, label_buf, '\0');
+    if (last_region == g && !strcmp(last_label, label_buf.a)) return last_label;
+    const char *label = NULL;
+    pthread_mutex_lock(&label_mu);
+    for (size_t i = 0; i < kv_size(g->labels) && !label; ++i) {
+        if (!strcmp(kv_A(g->labels, i), label_buf.a)) label = kv_A(g->labels, i);
+    }
+    if (!label) {
+        char *copy = strdup(label_buf.a);
+        if (!copy) fatal("Memory allocation failed");
+        kv_push(char *, g->labels, copy);
+        label = copy;
+    }
+    pthread_mutex_unlock(&label_mu);
+    last_region = g;
+    last_label = label;
+    return label;
+}
+
+size_t regions_find(const regionVec *r, const char *chrom, size_t *n)
+{
+    size_t lo = 0, hi = kv_size(*r);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(kv_A(*r, mid).chrom, chrom) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    for (hi = lo; hi < kv_size(*r) && !strcmp(kv_A(*r, hi).chrom, chrom); ++hi);
+    *n = hi - lo;
+    return lo;
+}
+
+void regions_destroy(regionVec *r)
+{
+    for (size_t i = 0; i < kv_size(*r); ++i) {
+        struct region *g = &kv_A(*r, i);
+        free(g->chrom);
+        free(g->id);
+        for (size_t j = 0; j < kv_size(g->parts); ++j) free(kv_A(g->parts, j).id);
+        for (size_t j = 0; j < kv_size(g->labels); ++j) free(kv_A(g->labels, j));
+        kv_destroy(g->parts);
+        kv_destroy(g->labels);
+    }
+    kv_destroy(*r);
+}
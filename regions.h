@@ -0,0 +1,53 @@
+// ****************************************
+// Target regions (BED), sorted and merged
+// ----------------------------------------
+
+#ifndef _REGIONS_H
+#define _REGIONS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "kvec.h"
+
+/* An interval of the BED file, kept within the merged interval it overlaps */
+struct region_part {
+    uint64_t start;
+    uint64_t end;
+    char *id;
+};
+
+typedef kvec_t(struct region_part) regionPartVec;
+
+/* 0-based, end exclusive; id is the name column, or chrom:start-end when there is none */
+struct region {
+    char *chrom;
+    uint64_t start;
+    uint64_t end;
+    char *id;              /* NULL once merged, the ids are those of the parts */
+    regionPartVec parts;   /* the intervals merged into this one, by start; empty when it stands alone */
+    kvec_t(char *) labels; /* ids of the parts around a hit, joined once per distinct set */
+};
+
+typedef kvec_t(struct region) regionVec;
+
+/* Append the intervals of a BED file to r, skipping comments, track and browser lines; returns their number */
+int regions_read_bed(const char *path, regionVec *r);
+/**
+ * @brief Sort by chromosome name then start, and merge the intervals that
+ * overlap; touching ones stay apart. A merged interval keeps its intervals
+ * as parts, so that a hit is labelled with the ids of those around it.
+ */
+void regions_merge(regionVec *r);
+/**
+ * @brief Ids of the intervals of g containing [start, end), joined with
+ * commas; NULL when none does, for a hit across two overlapping intervals.
+ * The string lives until regions_destroy. Thread-safe: each thread reuses
+ * its last label while the set is the same, the others are shared under a
+ * lock.
+ */
+const char *regions_label(struct region *g, uint64_t start, uint64_t end);
+/* Index of the first interval of chrom in a merged vector, *n is set to their number */
+size_t regions_find(const regionVec *r, const char *chrom, size_t *n);
+void regions_destroy(regionVec *r);
+
+#endif
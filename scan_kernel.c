@@ -0,0 +1,584 @@
+// ****************************************
+// Vectorized IUPAC scanning kernels
+// ----------------------------------------
+
+#include "scan_kernel.h"
+#include "motifSearch.h"
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+/* Extra encoded bytes after a block, so that vector loads never run past it */
+#define SCAN_PAD 64
+
+static const uint8_t ntOneHot[256] = {
+    ['A'] = 1, ['C'] = 2, ['G'] = 4, ['T'] = 8,
+    ['a'] = 1, ['c'] = 2, ['g'] = 4, ['t'] = 8,
+};
+
+void scan_motif_init(scan_motif_t *m, const char *motif, int max_mismatches)
+{
+    int len = strlen(motif);
+    if (len == 0 || len > SCAN_MAX_LEN) fatalf("Error: motif length must be between 1 and %d\n", SCAN_MAX_LEN);
+    if (max_mismatches < 0 || max_mismatches > SCAN_MAX_MISMATCHES || max_mismatches >= len) {
+        fatalf("Error: mismatches must be between 0 and min(%d, motif length - 1)\n", SCAN_MAX_MISMATCHES);
+    }
+    memset(m, 0, sizeof(scan_motif_t));
+    m->len = len;
+    m->max_mismatches = max_mismatches;
+    for (int i = 0; i < len; ++i) {
+        m->fwd[i] = iupac_to_mask(motif[i]);
+        m->rev[i] = iupac_complement_mask(iupac_to_mask(motif[len - 1 - i]));
+        for (int v = 0; v < 16; ++v) {
+            if (v & m->fwd[i]) m->bfwd[v] |= 1ULL << i;
+            if (v & m->rev[i]) m->brev[v] |= 1ULL << i;
+        }
+    }
+}
+
+/**
+ * @brief Segment encoders fold the case and map a run of contiguous bases
+ * to the one-hot code in one pass. The vector ones cover a segment with
+ * full-width loads, the last one overlapping the previous, so only runs
+ * shorter than a vector fall back to the table.
+ */
+static void encode_segment_scalar(const unsigned char *seq, uint64_t n, uint8_t *enc)
+{
+    for (uint64_t i = 0; i < n; ++i) {
+        enc[i] = ntOneHot[seq[i]];
+    }
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse4.2")))
+static void encode_segment_sse42(const unsigned char *seq, uint64_t n, uint8_t *enc)
+{
+    if (n < 16) {
+        encode_segment_scalar(seq, n, enc);
+        return;
+    }
+    const __m128i fold = _mm_set1_epi8((char)0xDF);
+    for (uint64_t i = 0;; i += 16) {
+        if (i > n - 16) i = n - 16;
+        __m128i u = _mm_and_si128(_mm_loadu_si128((const __m128i *)(seq + i)), fold);
+        __m128i x = _mm_and_si128(_mm_cmpeq_epi8(u, _mm_set1_epi8('A')), _mm_set1_epi8(1));
+        x = _mm_or_si128(x, _mm_and_si128(_mm_cmpeq_epi8(u, _mm_set1_epi8('C')), _mm_set1_epi8(2)));
+        x = _mm_or_si128(x, _mm_and_si128(_mm_cmpeq_epi8(u, _mm_set1_epi8('G')), _mm_set1_epi8(4)));
+        x = _mm_or_si128(x, _mm_and_si128(_mm_cmpeq_epi8(u, _mm_set1_epi8('T')), _mm_set1_epi8(8)));
+        _mm_storeu_si128((__m128i *)(enc + i), x);
+        if (i == n - 16) break;
+    }
+}
+
+__attribute__((target("avx2")))
+static void encode_segment_avx2(const unsigned char *seq, uint64_t n, uint8_t *enc)
+{
+    if (n < 32) {
+        encode_segment_sse42(seq, n, enc);
+        return;
+    }
+    const __m256i fold = _mm256_set1_epi8((char)0xDF);
+    for (uint64_t i = 0;; i += 32) {
+        if (i > n - 32) i = n - 32;
+        __m256i u = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(seq + i)), fold);
+        __m256i x = _mm256_and_si256(_mm256_cmpeq_epi8(u, _mm256_set1_epi8('A')), _mm256_set1_epi8(1));
+        x = _mm256_or_si256(x, _mm256_and_si256(_mm256_cmpeq_epi8(u, _mm256_set1_epi8('C')), _mm256_set1_epi8(2)));
+        x = _mm256_or_si256(x, _mm256_and_si256(_mm256_cmpeq_epi8(u, _mm256_set1_epi8('G')), _mm256_set1_epi8(4)));
+        x = _mm256_or_si256(x, _mm256_and_si256(_mm256_cmpeq_epi8(u, _mm256_set1_epi8('T')), _mm256_set1_epi8(8)));
+        _mm256_storeu_si256((__m256i *)(enc + i), x);
+        if (i == n - 32) break;
+    }
+}
+#endif
+
+typedef void (*encode_segment_fn)(const unsigned char *seq, uint64_t n, uint8_t *enc);
+static encode_segment_fn encode_segment = encode_segment_scalar;
+
+/* Encode len bases from pos; the newlines are skipped with the fixed line geometry of the view */
+void scan_encode(const FastaView *v, uint64_t pos, uint64_t len, uint8_t *enc)
+{
+    uint64_t n;
+    for (uint64_t end = pos + len; pos < end; pos += n) {
+        const unsigned char *seq = (const unsigned char *)fastaViewSegment(v, pos, end, &n);
+        encode_segment(seq, n, enc);
+        enc += n;
+    }
+}
+
+/* Report the hits of a group of candidates, forward strand first at each position */
+static inline void report_bits(uint64_t hf, uint64_t hr, uint64_t pos, scan_callback_t callback, void *arg)
+{
+    uint64_t any = hf | hr;
+    while (any) {
+        int b = __builtin_ctzll(any);
+        if ((hf >> b) & 1) callback(arg, pos + b, '+', 0);
+        if ((hr >> b) & 1) callback(arg, pos + b, '-', 0);
+        any &= any - 1;
+    }
+}
+
+/* Same for the mismatch kernels, with the per-lane mismatch counts */
+static inline void report_bits_mm(uint64_t hf, uint64_t hr, const uint8_t *nf, const uint8_t *nr, uint64_t pos, scan_callback_t callback, void *arg)
+{
+    uint64_t any = hf | hr;
+    while (any) {
+        int b = __builtin_ctzll(any);
+        if ((hf >> b) & 1) callback(arg, pos + b, '+', nf[b]);
+        if ((hr >> b) & 1) callback(arg, pos + b, '-', nr[b]);
+        any &= any - 1;
+    }
+}
+
+/**
+ * @brief Each kernel tests the n candidate positions starting at enc[0]
+ * against the motif; enc holds n + len - 1 encoded bases followed by
+ * SCAN_PAD zero bytes. offset is the sequence coordinate of enc[0].
+ */
+static void scan_kernel_scalar(const scan_motif_t *m, const uint8_t *enc, uint64_t n, uint64_t offset, scan_callback_t callback, void *arg)
+{
+    const uint64_t hit = 1ULL << (m->len - 1);
+    uint64_t f = 0, r = 0;
+    for (uint64_t i = 0; i < n + m->len - 1; ++i) {
+        f = ((f << 1) | 1) & m->bfwd[enc[i]];
+        r = ((r << 1) | 1) & m->brev[enc[i]];
+        if (unlikely((f | r) & hit)) {
+            if (f & hit) callback(arg, offset + i + 1 - m->len, '+', 0);
+            if (r & hit) callback(arg, offset + i + 1 - m->len, '-', 0);
+        }
+    }
+}
+
+/* Wu-Manber extension of Shift-And: row d holds the prefixes matched with at most d mismatches */
+static void scan_kernel_mm_scalar(const scan_motif_t *m, const uint8_t *enc, uint64_t n, uint64_t offset, scan_callback_t callback, void *arg)
+{
+    const uint64_t hit = 1ULL << (m->len - 1);
+    const int k = m->max_mismatches;
+    uint64_t f[SCAN_MAX_MISMATCHES + 1] = {0}, r[SCAN_MAX_MISMATCHES + 1] = {0};
+    for (uint64_t i = 0; i < n + m->len - 1; ++i) {
+        uint64_t bf = m->bfwd[enc[i]], br = m->brev[enc[i]];
+        uint64_t pf = f[0], pr = r[0];
+        f[0] = ((f[0] << 1) | 1) & bf;
+        r[0] = ((r[0] << 1) | 1) & br;
+        for (int d = 1; d <= k; ++d) {
+            uint64_t of = f[d], or = r[d];
+            f[d] = (((f[d] << 1) | 1) & bf) | ((pf << 1) | 1);
+            r[d] = (((r[d] << 1) | 1) & br) | ((pr << 1) | 1);
+            pf = of;
+            pr = or;
+        }
+        if (unlikely((f[k] | r[k]) & hit)) {
+            uint64_t pos = offset + i + 1 - m->len;
+            for (int d = 0; d <= k; ++d) {
+                if (f[d] & hit) {
+                    callback(arg, pos, '+', d);
+                    break;
+                }
+            }
+            for (int d = 0; d <= k; ++d) {
+                if (r[d] & hit) {
+                    callback(arg, pos, '-', d);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/* Verify the candidates of the quantized PWM prefilter with the exact score */
+static inline void report_pwm(const pwm_t *p, uint64_t hf, uint64_t hr, const uint8_t *enc, uint64_t pos, pwm_callback_t callback, void *arg)
+{
+    uint64_t any = hf | hr;
+    while (any) {
+        int b = __builtin_ctzll(any);
+        double s;
+        if (((hf >> b) & 1) && (s = pwm_score(p, enc + b, '+')) >= p->threshold) callback(arg, p, pos + b, '+', s);
+        if (((hr >> b) & 1) && (s = pwm_score(p, enc + b, '-')) >= p->threshold) callback(arg, p, pos + b, '-', s);
+        any &= any - 1;
+    }
+}
+
+/**
+ * @brief The PWM kernels sum the int8 log-odds of every candidate window
+ * from per-position tables indexed by the encoded base, and verify the
+ * windows whose sum reaches the quantized threshold.
+ */
+static void pwm_kernel_scalar(const pwm_t *p, const uint8_t *enc, uint64_t n, uint64_t offset, pwm_callback_t callback, void *arg)
+{
+    for (uint64_t i = 0; i < n; ++i) {
+        int sf = 0, sr = 0;
+        for (int j = 0; j < p->len; ++j) {
+            sf += p->qfwd[j][enc[i + j]];
+            sr += p->qrev[j][enc[i + j]];
+        }
+        if (unlikely(sf >= p->qthreshold || sr >= p->qthreshold)) {
+            report_pwm(p, sf >= p->qthreshold, sr >= p->qthreshold, enc + i, offset + i, callback, arg);
+        }
+    }
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse4.2")))
+static void scan_kernel_sse42(const scan_motif_t *m, const uint8_t *enc, uint64_t n, uint64_t offset, scan_callback_t callback, void *arg)
+{
+    const __m128i zero = _mm_setzero_si128();
+    for (uint64_t i = 0; i < n; i += 16) {
+        __m128i okf = _mm_set1_epi8(-1), okr = okf;
+        for (int j = 0; j < m->len; ++j) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(enc + i + j));
+            okf = _mm_andnot_si128(_mm_cmpeq_epi8(_mm_and_si128(x, _mm_set1_epi8(m->fwd[j])), zero), okf);
+            okr = _mm_andnot_si128(_mm_cmpeq_epi8(_mm_and_si128(x, _mm_set1_epi8(m->rev[j])), zero), okr);
+            /* most candidate groups fail within the first few positions,
+             * test every 4 positions to keep the branch predictable */
+            __m128i ok = _mm_or_si128(okf, okr);
+            if ((j & 3) == 3 && _mm_testz_si128(ok, ok)) break;
+        }
+        uint64_t hf = (uint32_t)_mm_movemask_epi8(okf), hr = (uint32_t)_mm_movemask_epi8(okr);
+        if (!(hf | hr)) continue;
+        if (n - i < 16) {
+            hf &= (1ULL << (n - i)) - 1;
+            hr &= (1ULL << (n - i)) - 1;
+        }
+        report_bits(hf, hr, offset + i, callback, arg);
+    }
+}
+
+/* The mismatch kernels count the failing positions of every lane in a byte */
+__attribute__((target("sse4.2")))
+static void scan_kernel_mm_sse42(const scan_motif_t *m, const uint8_t *enc, uint64_t n, uint64_t offset, scan_callback_t callback, void *arg)
+{
+    const __m128i zero = _mm_setzero_si128(), kv = _mm_set1_epi8(m->max_mismatches);
+    uint8_t nf[16], nr[16];
+    for (uint64_t i = 0; i < n; i += 16) {
+        __m128i cf = zero, cr = zero, okf, okr;
+        for (int j = 0; j < m->len; ++j) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(enc + i + j));
+            cf = _mm_sub_epi8(cf, _mm_cmpeq_epi8(_mm_and_si128(x, _mm_set1_epi8(m->fwd[j])), zero));
+            cr = _mm_sub_epi8(cr, _mm_cmpeq_epi8(_mm_and_si128(x, _mm_set1_epi8(m->rev[j])), zero));
+            if (j >= m->max_mismatches && (j & 3) == 3) {
+                /* lanes with cnt <= k, i.e. max(cnt, k) == k */
+                okf = _mm_cmpeq_epi8(_mm_max_epu8(cf, kv), kv);
+                okr = _mm_cmpeq_epi8(_mm_max_epu8(cr, kv), kv);
+                __m128i ok = _mm_or_si128(okf, okr);
+                if (_mm_testz_si128(ok, ok)) break;
+            }
+        }
+        okf = _mm_cmpeq_epi8(_mm_max_epu8(cf, kv), kv);
+        okr = _mm_cmpeq_epi8(_mm_max_epu8(cr, kv), kv);
+        uint64_t hf = (uint32_t)_mm_movemask_epi8(okf), hr = (uint32_t)_mm_movemask_epi8(okr);
+        if (n - i < 16) {
+            hf &= (1ULL << (n - i)) - 1;
+            hr &= (1ULL << (n - i)) - 1;
+        }
+        if (!(hf | hr)) continue;
+        _mm_storeu_si128((__m128i *)nf, cf);
+        _mm_storeu_si128((__m128i *)nr, cr);
+        report_bits_mm(hf, hr, nf, nr, offset + i, callback, arg);
+    }
+}
+
+__attribute__((target("avx2")))
+static void scan_kernel_avx2(const scan_motif_t *m, const uint8_t *enc, uint64_t n, uint64_t offset, scan_callback_t callback, void *arg)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    for (uint64_t i = 0; i < n; i += 32) {
+        __m256i okf = _mm256_set1_epi8(-1), okr = okf;
+        for (int j = 0; j < m->len; ++j) {
+            __m256i x = _mm256_loadu_si256((const __m256i *)(enc + i + j));
+            okf = _mm256_andnot_si256(_mm256_cmpeq_epi8(_mm256_and_si256(x, _mm256_set1_epi8(m->fwd[j])), zero), okf);
+            okr = _mm256_andnot_si256(_mm256_cmpeq_epi8(_mm256_and_si256(x, _mm256_set1_epi8(m->rev[j])), zero), okr);
+            __m256i ok = _mm256_or_si256(okf, okr);
+            if ((j & 3) == 3 && _mm256_testz_si256(ok, ok)) break;
+        }
+        uint64_t hf = (uint32_t)_mm256_movemask_epi8(okf), hr = (uint32_t)_mm256_movemask_epi8(okr);
+        if (!(hf | hr)) continue;
+        if (n - i < 32) {
+            hf &= (1ULL << (n - i)) - 1;
+            hr &= (1ULL << (n - i)) - 1;
+        }
+        report_bits(hf, hr, offset + i, callback, arg);
+    }
+}
+
+__attribute__((target("avx2")))
+static void scan_kernel_mm_avx2(const scan_motif_t *m, const uint8_t *enc, uint64_t n, uint64_t offset, scan_callback_t callback, void *arg)
+{
+    const __m256i zero = _mm256_setzero_si256(), kv = _mm256_set1_epi8(m->max_mismatches);
+    uint8_t nf[32], nr[32];
+    for (uint64_t i = 0; i < n; i += 32) {
+        __m256i cf = zero, cr = zero, okf, okr;
+        for (int j = 0; j < m->len; ++j) {
+            __m256i x = _mm256_loadu_si256((const __m256i *)(enc + i + j));
+            cf = _mm256_sub_epi8(cf, _mm256_cmpeq_epi8(_mm256_and_si256(x, _mm256_set1_epi8(m->fwd[j])), zero));
+            cr = _mm256_sub_epi8(cr, _mm256_cmpeq_epi8(_mm256_and_si256(x, _mm256_set1_epi8(m->rev[j])), zero));
+            if (j >= m->max_mismatches && (j & 3) == 3) {
+                okf = _mm256_cmpeq_epi8(_mm256_max_epu8(cf, kv), kv);
+                okr = _mm256_cmpeq_epi8(_mm256_max_epu8(cr, kv), kv);
+                __m256i ok = _mm256_or_si256(okf, okr);
+                if (_mm256_testz_si256(ok, ok)) break;
+            }
+        }
+        okf = _mm256_cmpeq_epi8(_mm256_max_epu8(cf, kv), kv);
+        okr = _mm256_cmpeq_epi8(_mm256_max_epu8(cr, kv), kv);
+        uint64_t hf = (uint32_t)_mm256_movemask_epi8(okf), hr = (uint32_t)_mm256_movemask_epi8(okr);
+        if (n - i < 32) {
+            hf &= (1ULL << (n - i)) - 1;
+            hr &= (1ULL << (n - i)) - 1;
+        }
+        if (!(hf | hr)) continue;
+        _mm256_storeu_si256((__m256i *)nf, cf);
+        _mm256_storeu_si256((__m256i *)nr, cr);
+        report_bits_mm(hf, hr, nf, nr, offset + i, callback, arg);
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void scan_kernel_avx512(const scan_motif_t *m, const uint8_t *enc, uint64_t n, uint64_t offset, scan_callback_t callback, void *arg)
+{
+    for (uint64_t i = 0; i < n; i += 64) {
+        __mmask64 okf = ~0ULL, okr = ~0ULL;
+        for (int j = 0; j < m->len; ++j) {
+            __m512i x = _mm512_loadu_si512((const void *)(enc + i + j));
+            okf &= _mm512_test_epi8_mask(x, _mm512_set1_epi8(m->fwd[j]));
+            okr &= _mm512_test_epi8_mask(x, _mm512_set1_epi8(m->rev[j]));
+            if ((j & 3) == 3 && !(okf | okr)) break;
+        }
+        uint64_t hf = okf, hr = okr;
+        if (!(hf | hr)) continue;
+        if (n - i < 64) {
+            hf &= (1ULL << (n - i)) - 1;
+            hr &= (1ULL << (n - i)) - 1;
+        }
+        report_bits(hf, hr, offset + i, callback, arg);
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void scan_kernel_mm_avx512(const scan_motif_t *m, const uint8_t *enc, uint64_t n, uint64_t offset, scan_callback_t callback, void *arg)
+{
+    const __m512i zero = _mm512_setzero_si512(), one = _mm512_set1_epi8(1), kv = _mm512_set1_epi8(m->max_mismatches);
+    uint8_t nf[64], nr[64];
+    for (uint64_t i = 0; i < n; i += 64) {
+        __m512i cf = zero, cr = zero;
+        __mmask64 okf = ~0ULL, okr = ~0ULL;
+        for (int j = 0; j < m->len; ++j) {
+            __m512i x = _mm512_loadu_si512((const void *)(enc + i + j));
+            cf = _mm512_mask_add_epi8(cf, ~_mm512_test_epi8_mask(x, _mm512_set1_epi8(m->fwd[j])), cf, one);
+            cr = _mm512_mask_add_epi8(cr, ~_mm512_test_epi8_mask(x, _mm512_set1_epi8(m->rev[j])), cr, one);
+            if (j >= m->max_mismatches && (j & 3) == 3) {
+                okf = _mm512_cmple_epu8_mask(cf, kv);
+                okr = _mm512_cmple_epu8_mask(cr, kv);
+                if (!(okf | okr)) break;
+            }
+        }
+        uint64_t hf = _mm512_cmple_epu8_mask(cf, kv), hr = _mm512_cmple_epu8_mask(cr, kv);
+        if (n - i < 64) {
+            hf &= (1ULL << (n - i)) - 1;
+            hr &= (1ULL << (n - i)) - 1;
+        }
+        if (!(hf | hr)) continue;
+        _mm512_storeu_si512((void *)nf, cf);
+        _mm512_storeu_si512((void *)nr, cr);
+        report_bits_mm(hf, hr, nf, nr, offset + i, callback, arg);
+    }
+}
+/* pshufb looks up the int8 score of 16 or more windows at once, the sums are widened to int16 */
+__attribute__((target("sse4.2")))
+static void pwm_kernel_sse42(const pwm_t *p, const uint8_t *enc, uint64_t n, uint64_t offset, pwm_callback_t callback, void *arg)
+{
+    const __m128i thr = _mm_set1_epi16(p->qthreshold - 1);
+    for (uint64_t i = 0; i < n; i += 16) {
+        __m128i f0 = _mm_setzero_si128(), f1 = f0, r0 = f0, r1 = f0;
+        for (int j = 0; j < p->len; ++j) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(enc + i + j));
+            __m128i sf = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p->qfwd[j]), x);
+            __m128i sr = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p->qrev[j]), x);
+            f0 = _mm_add_epi16(f0, _mm_cvtepi8_epi16(sf));
+            f1 = _mm_add_epi16(f1, _mm_cvtepi8_epi16(_mm_srli_si128(sf, 8)));
+            r0 = _mm_add_epi16(r0, _mm_cvtepi8_epi16(sr));
+            r1 = _mm_add_epi16(r1, _mm_cvtepi8_epi16(_mm_srli_si128(sr, 8)));
+        }
+        uint64_t hf = (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(_mm_cmpgt_epi16(f0, thr), _mm_cmpgt_epi16(f1, thr)));
+        uint64_t hr = (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(_mm_cmpgt_epi16(r0, thr), _mm_cmpgt_epi16(r1, thr)));
+        if (!(hf | hr)) continue;
+        if (n - i < 16) {
+            hf &= (1ULL << (n - i)) - 1;
+            hr &= (1ULL << (n - i)) - 1;
+        }
+        report_pwm(p, hf, hr, enc + i, offset + i, callback, arg);
+    }
+}
+
+__attribute__((target("avx2")))
+static void pwm_kernel_avx2(const pwm_t *p, const uint8_t *enc, uint64_t n, uint64_t offset, pwm_callback_t callback, void *arg)
+{
+    const __m256i thr = _mm256_set1_epi16(p->qthreshold - 1);
+    for (uint64_t i = 0; i < n; i += 32) {
+        __m256i f0 = _mm256_setzero_si256(), f1 = f0, r0 = f0, r1 = f0;
+        for (int j = 0; j < p->len; ++j) {
+            __m256i x = _mm256_loadu_si256((const __m256i *)(enc + i + j));
+            __m256i sf = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)p->qfwd[j])), x);
+            __m256i sr = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)p->qrev[j])), x);
+            f0 = _mm256_add_epi16(f0, _mm256_cvtepi8_epi16(_mm256_castsi256_si128(sf)));
+            f1 = _mm256_add_epi16(f1, _mm256_cvtepi8_epi16(_mm256_extracti128_si256(sf, 1)));
+            r0 = _mm256_add_epi16(r0, _mm256_cvtepi8_epi16(_mm256_castsi256_si128(sr)));
+            r1 = _mm256_add_epi16(r1, _mm256_cvtepi8_epi16(_mm256_extracti128_si256(sr, 1)));
+        }
+        /* packs works within 128-bit lanes, the permute restores the window order */
+        __m256i cf = _mm256_permute4x64_epi64(_mm256_packs_epi16(_mm256_cmpgt_epi16(f0, thr), _mm256_cmpgt_epi16(f1, thr)), 0xD8);
+        __m256i cr = _mm256_permute4x64_epi64(_mm256_packs_epi16(_mm256_cmpgt_epi16(r0, thr), _mm256_cmpgt_epi16(r1, thr)), 0xD8);
+        uint64_t hf = (uint32_t)_mm256_movemask_epi8(cf), hr = (uint32_t)_mm256_movemask_epi8(cr);
+        if (!(hf | hr)) continue;
+        if (n - i < 32) {
+            hf &= (1ULL << (n - i)) - 1;
+            hr &= (1ULL << (n - i)) - 1;
+        }
+        report_pwm(p, hf, hr, enc + i, offset + i, callback, arg);
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void pwm_kernel_avx512(const pwm_t *p, const uint8_t *enc, uint64_t n, uint64_t offset, pwm_callback_t callback, void *arg)
+{
+    const __m512i thr = _mm512_set1_epi16(p->qthreshold);
+    for (uint64_t i = 0; i < n; i += 64) {
+        __m512i f0 = _mm512_setzero_si512(), f1 = f0, r0 = f0, r1 = f0;
+        for (int j = 0; j < p->len; ++j) {
+            __m512i x = _mm512_loadu_si512((const void *)(enc + i + j));
+            __m512i sf = _mm512_shuffle_epi8(_mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)p->qfwd[j])), x);
+            __m512i sr = _mm512_shuffle_epi8(_mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)p->qrev[j])), x);
+            f0 = _mm512_add_epi16(f0, _mm512_cvtepi8_epi16(_mm512_castsi512_si256(sf)));
+            f1 = _mm512_add_epi16(f1, _mm512_cvtepi8_epi16(_mm512_extracti64x4_epi64(sf, 1)));
+            r0 = _mm512_add_epi16(r0, _mm512_cvtepi8_epi16(_mm512_castsi512_si256(sr)));
+            r1 = _mm512_add_epi16(r1, _mm512_cvtepi8_epi16(_mm512_extracti64x4_epi64(sr, 1)));
+        }
+        uint64_t hf = (uint64_t)_mm512_cmpge_epi16_mask(f0, thr) | (uint64_t)_mm512_cmpge_epi16_mask(f1, thr) << 32;
+        uint64_t hr = (uint64_t)_mm512_cmpge_epi16_mask(r0, thr) | (uint64_t)_mm512_cmpge_epi16_mask(r1, thr) << 32;
+        if (!(hf | hr)) continue;
+        if (n - i < 64) {
+            hf &= (1ULL << (n - i)) - 1;
+            hr &= (1ULL << (n - i)) - 1;
+        }
+        report_pwm(p, hf, hr, enc + i, offset + i, callback, arg);
+    }
+}
+#endif
+
+typedef void (*scan_kernel_fn)(const scan_motif_t *m, const uint8_t *enc, uint64_t n, uint64_t offset, scan_callback_t callback, void *arg);
+typedef void (*pwm_kernel_fn)(const pwm_t *p, const uint8_t *enc, uint64_t n, uint64_t offset, pwm_callback_t callback, void *arg);
+
+struct scan_kernel_variant {
+    const char *name;
+    scan_kernel_fn fn;
+    scan_kernel_fn fn_mm; /* used when max_mismatches > 0 */
+    pwm_kernel_fn fn_pwm;
+    encode_segment_fn fn_encode;
+    bool (*supported)(void);
+};
+
+static bool cpu_any(void) { return true; }
+#ifdef SCAN_X86
+static bool cpu_sse42(void) { return __builtin_cpu_supports("sse4.2"); }
+static bool cpu_avx2(void) { return __builtin_cpu_supports("avx2"); }
+static bool cpu_avx512(void) { return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"); }
+#endif
+
+/* Ordered from the most to the least preferred */
+static const struct scan_kernel_variant scan_kernels[] = {
+#ifdef SCAN_X86
+    {"avx512", scan_kernel_avx512, scan_kernel_mm_avx512, pwm_kernel_avx512, encode_segment_avx2, cpu_avx512},
+    {"avx2", scan_kernel_avx2, scan_kernel_mm_avx2, pwm_kernel_avx2, encode_segment_avx2, cpu_avx2},
+    {"sse42", scan_kernel_sse42, scan_kernel_mm_sse42, pwm_kernel_sse42, encode_segment_sse42, cpu_sse42},
+#endif
+    {"scalar", scan_kernel_scalar, scan_kernel_mm_scalar, pwm_kernel_scalar, encode_segment_scalar, cpu_any},
+};
+#define N_SCAN_KERNELS (sizeof(scan_kernels) / sizeof(scan_kernels[0]))
+
+/* Selected once at startup by scan_kernel_init, read-only afterwards */
+static scan_kernel_fn scan_kernel = scan_kernel_scalar;
+static scan_kernel_fn scan_kernel_mm = scan_kernel_mm_scalar;
+static pwm_kernel_fn pwm_kernel = pwm_kernel_scalar;
+static const char *scan_kernel_selected = "scalar";
+
+void scan_kernel_init(const char *name)
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+#endif
+    bool any = !name || strcmp(name, "auto") == 0;
+    for (size_t i = 0; i < N_SCAN_KERNELS; ++i) {
+        if (!any && strcmp(name, scan_kernels[i].name) != 0) continue;
+        if (!scan_kernels[i].supported()) {
+            if (any) continue;
+            fatalf("Error: kernel %s is not supported by this CPU\n", name);
+        }
+        scan_kernel = scan_kernels[i].fn;
+        scan_kernel_mm = scan_kernels[i].fn_mm;
+        pwm_kernel = scan_kernels[i].fn_pwm;
+        encode_segment = scan_kernels[i].fn_encode;
+        scan_kernel_selected = scan_kernels[i].name;
+        return;
+    }
+    fatalf("Error: unknown kernel %s\n", name);
+}
+
+bool scan_kernel_supported(const char *name)
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+#endif
+    for (size_t i = 0; i < N_SCAN_KERNELS; ++i) {
+        if (strcmp(name, scan_kernels[i].name) == 0) return scan_kernels[i].supported();
+    }
+    return false;
+}
+
+const char *scan_kernel_name(void)
+{
+    return scan_kernel_selected;
+}
+
+void scan_search(const scan_motif_t *m, const FastaView *v, scan_callback_t callback, void *arg)
+{
+    uint8_t enc[SCAN_BLOCK + SCAN_MAX_LEN + SCAN_PAD] __attribute__((aligned(32)));
+    uint64_t seq_len = v->length;
+    if (seq_len < (uint64_t)m->len) return;
+    uint64_t n_cand = seq_len - m->len + 1;
+    scan_kernel_fn kernel = m->max_mismatches ? scan_kernel_mm : scan_kernel;
+    for (uint64_t b = 0; b < n_cand; b += SCAN_BLOCK) {
+        uint64_t n = n_cand - b < SCAN_BLOCK ? n_cand - b : SCAN_BLOCK;
+        uint64_t n_enc = n + m->len - 1;
+        scan_encode(v, b, n_enc, enc);
+        memset(enc + n_enc, 0, SCAN_PAD);
+        kernel(m, enc, n, b, callback, arg);
+    }
+}
+
+/**
+ * @brief Every block is encoded once and scanned by all the motifs while
+ * it is still in cache; the candidates of a motif stop len - 1 bases
+ * before the end of the sequence, so shorter motifs see more of the last
+ * block.
+ */
+void scan_pwm_search(const pwm_t *const *p, int n_pwm, const FastaView *v, pwm_callback_t callback, void *arg)
+{
+    uint8_t enc[SCAN_BLOCK + SCAN_MAX_LEN + SCAN_PAD] __attribute__((aligned(32)));
+    uint64_t seq_len = v->length;
+    int min_len = SCAN_MAX_LEN, max_len = 1;
+    for (int k = 0; k < n_pwm; ++k) {
+        if (p[k]->len < min_len) min_len = p[k]->len;
+        if (p[k]->len > max_len) max_len = p[k]->len;
+    }
+    if (n_pwm == 0 || seq_len < (uint64_t)min_len) return;
+    uint64_t n_cand = seq_len - min_len + 1, span = SCAN_BLOCK + max_len - 1;
+    for (uint64_t b = 0; b < n_cand; b += SCAN_BLOCK) {
+        uint64_t n_enc = seq_len - b < span ? seq_len - b : span;
+        scan_encode(v, b, n_enc, enc);
+        memset(enc + n_enc, 0, SCAN_PAD);
+        for (int k = 0; k < n_pwm; ++k) {
+            if (seq_len - b < (uint64_t)p[k]->len) continue;
+            uint64_t n = seq_len - b - p[k]->len + 1;
+            pwm_kernel(p[k], enc, n < SCAN_BLOCK ? n : SCAN_BLOCK, b, callback, arg);
+        }
+    }
+}
@@ -0,0 +1,48 @@
+// ****************************************
+// Vectorized IUPAC scanning kernels
+// ----------------------------------------
+
+#ifndef _SCAN_KERNEL_H
+#define _SCAN_KERNEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "fasta.h"
+#include "pwm.h"
+
+#define SCAN_MAX_LEN 64
+/* Largest Hamming distance accepted by scan_motif_init */
+#define SCAN_MAX_MISMATCHES 16
+/* Candidate positions encoded per block, small enough to stay in L1/L2 */
+#define SCAN_BLOCK 16384
+
+typedef void (*scan_callback_t)(void *arg, uint64_t pos, char strand, int mismatches);
+
+/**
+ * @brief Per-position nucleotide masks of a motif and of its reverse
+ * complement. The sequence is encoded one byte per base (A=1, C=2, G=4,
+ * T=8, anything else 0), so a position matches when the encoded byte
+ * shares a bit with the mask.
+ */
+typedef struct scan_motif {
+    int len;
+    int max_mismatches; /* report sites within this Hamming distance */
+    uint8_t fwd[SCAN_MAX_LEN];
+    uint8_t rev[SCAN_MAX_LEN];
+    /* Shift-And tables indexed by the encoded byte, for the scalar kernel */
+    uint64_t bfwd[16];
+    uint64_t brev[16];
+} scan_motif_t;
+
+void scan_motif_init(scan_motif_t *m, const char *motif, int max_mismatches);
+void scan_encode(const FastaView *v, uint64_t pos, uint64_t len, uint8_t *enc);
+void scan_search(const scan_motif_t *m, const FastaView *v, scan_callback_t callback, void *arg);
+/* Report the windows scoring at least the threshold of each PWM, on both strands */
+void scan_pwm_search(const pwm_t *const *p, int n_pwm, const FastaView *v, pwm_callback_t callback, void *arg);
+/* Pick the kernel variant from cpuid, or force one of avx512, avx2, sse42, scalar */
+void scan_kernel_init(const char *name);
+/* Whether the variant is compiled in and supported by this CPU, for the tests */
+bool scan_kernel_supported(const char *name);
+const char *scan_kernel_name(void);
+
+#endif
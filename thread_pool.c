@@ -52,15 +52,93 @@ DEALINGS IN THE SOFTWARE.  */
 #include <stdarg.h>
 #include <unistd.h>
 #include <limits.h>
+#include <sched.h>
 #include "thread_pool.h"
 
 /** Minimum stack size for threads.  Required for some rANS codecs
  * that use over 2Mbytes of stack for encoder / decoder state
 **/
 #define MIN_THREAD_STACK (3 * 1024 * 1024)
+/* Slots of each work-stealing queue, a power of two */
+#define TPOOL_DEQUE_SIZE 1024
+/* Random victims tried per round, and rounds an idle worker makes before going to sleep */
+#define TPOOL_WS_VICTIMS 4
+#define TPOOL_WS_SPINS 16
+
+/**
+ * @brief Bounded single-producer, multi-consumer ring of one worker. Not
+ * a Chase-Lev deque: the dispatcher, not the owner, is the only thread
+ * pushing at bottom, so the owner takes from top like the thieves, with a
+ * compare-and-swap that gives a job to exactly one worker. Taking in FIFO
+ * order also keeps the dispatch order, longest jobs first. top and bottom
+ * live on separate cache lines.
+ */
+struct tpool_deque {
+    int64_t top __attribute__((aligned(64)));
+    int64_t bottom __attribute__((aligned(64)));
+    tpool_job_t *buf[TPOOL_DEQUE_SIZE];
+};
+
+static void *tpool_ws_worker(void *arg);
+
+/* Take a job from the free list of the pool; the dispatcher holds tpool_mu or is the only one */
+static tpool_job_t *tpool_job_get(tpool_t *p)
+{
+    tpool_job_t *j = p->job_free;
+    if (!j) j = __atomic_exchange_n(&p->job_ret, NULL, __ATOMIC_ACQUIRE);
+    if (!j) return malloc(sizeof(*j));
+    p->job_free = j->next;
+    return j;
+}
 
+/* Any thread: a push-only stack has no ABA, the dispatcher empties it in one exchange */
+static void tpool_job_put(tpool_t *p, tpool_job_t *j)
+{
+    if (!p->recycle) {
+        free(j);
+        return;
+    }
+    j->next = __atomic_load_n(&p->job_ret, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&p->job_ret, &j->next, j, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void tpool_job_list_free(tpool_job_t *j)
+{
+    for (tpool_job_t *jn; j; j = jn) {
+        jn = j->next;
+        free(j);
+    }
+}
+
+/* Same scheme for the results of a process, taken under tpool_mu */
+static tpool_result_t *tpool_result_get(tpool_process_t *q)
+{
+    tpool_result_t *r = q->result_free;
+    if (!r) r = __atomic_exchange_n(&q->result_ret, NULL, __ATOMIC_ACQUIRE);
+    if (!r) return malloc(sizeof(*r));
+    q->result_free = r->next;
+    return r;
+}
+
+static void tpool_result_put(tpool_process_t *q, tpool_result_t *r)
+{
+    if (!q->p->recycle) {
+        free(r);
+        return;
+    }
+    r->next = __atomic_load_n(&q->result_ret, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&q->result_ret, &r->next, r, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void tpool_result_list_free(tpool_result_t *r)
+{
+    for (tpool_result_t *rn; r; r = rn) {
+        rn = r->next;
+        free(r);
+    }
+}
 
-tpool_t* tpool_init(int n) 
+static tpool_t *tpool_create(int n, bool ws)
 {
     int t_idx = 0;
     size_t stack_size = 0;
@@ -80,9 +158,20 @@ tpool_t* tpool_init(int n)
     p->t = malloc(n * sizeof(tpool_worker_t));
     if (!p->t) {free(p); return NULL;}
     p->t_stack = malloc(n * sizeof(int));
-    if (!p->t_stack) {free(p);free(p->t); return NULL;}
+    if (!p->t_stack) {free(p->t);free(p); return NULL;}
 
     p->t_stack_top = -1;
+    p->ws = ws;
+    p->deque = NULL;
+    p->ws_next = 0;
+    p->recycle = true;
+    p->job_free = NULL;
+    p->job_ret = NULL;
+    if (ws) {
+        if (posix_memalign((void **)&p->deque, 64, n * sizeof(struct tpool_deque))) {free(p->t_stack); free(p->t); free(p); return NULL;}
+        memset(p->deque, 0, n * sizeof(struct tpool_deque));
+        pthread_cond_init(&p->ws_c, NULL);
+    }
 
     pthread_mutexattr_t attr;
     pthread_mutexattr_init(&attr);
@@ -105,8 +194,10 @@ tpool_t* tpool_init(int n)
         p->t_stack[t_idx] = 0;
         w->p = p;
         w->idx = t_idx;
+        w->busy_time = 0;
+        w->n_jobs = 0;
         pthread_cond_init(&w->pending_c, NULL);
-        if (0 != pthread_create(&w->tid, &pattr, tpool_worker, w)) goto cleanup;
+        if (0 != pthread_create(&w->tid, &pattr, ws ? tpool_ws_worker : tpool_worker, w)) goto cleanup;
     }
 
     pthread_mutex_unlock(&p->tpool_mu);
@@ -120,12 +211,26 @@ cleanup:
     }
     pthread_mutex_destroy(&p->tpool_mu);
     if (pattr_init_done) pthread_attr_destroy(&pattr);
+    if (ws) {
+        pthread_cond_destroy(&p->ws_c);
+        free(p->deque);
+    }
     free(p->t_stack);
     free(p->t);
     free(p);
     return NULL;
 }
 
+tpool_t* tpool_init(int n)
+{
+    return tpool_create(n, false);
+}
+
+tpool_t* tpool_init_ws(int n)
+{
+    return tpool_create(n, true);
+}
+
 void tpool_destroy(tpool_t *p)
 {
     pthread_mutex_lock(&p->tpool_mu);
@@ -134,6 +239,7 @@ void tpool_destroy(tpool_t *p)
     for (int i = 0; i < p->tsize; i++) {
         pthread_cond_signal(&p->t[i].pending_c);
     }
+    if (p->ws) pthread_cond_broadcast(&p->ws_c);
     pthread_mutex_unlock(&p->tpool_mu);
     for (int i = 0; i < p->tsize; i++) {
         pthread_join(p->t[i].tid, NULL);
@@ -143,6 +249,12 @@ void tpool_destroy(tpool_t *p)
     for (int i = 0; i < p->tsize; i++) {
         pthread_cond_destroy(&p->t[i].pending_c);
     }
+    if (p->ws) {
+        pthread_cond_destroy(&p->ws_c);
+        free(p->deque);
+    }
+    tpool_job_list_free(p->job_free);
+    tpool_job_list_free(p->job_ret);
     if (p->t_stack) free(p->t_stack);
     free(p->t);
     free(p);
@@ -169,6 +281,10 @@ tpool_process_t *tpool_process_init(tpool_t *p, int qsize, bool in_only)
     q->n_job     = 0;
     q->n_result    = 0;
     q->n_processing= 0;
+    q->ws_pending  = 0;
+    q->ws_waiting  = 0;
+    q->result_free = NULL;
+    q->result_ret  = NULL;
     q->qsize       = qsize;
     q->in_only     = in_only;
     q->shutdown    = 0;
@@ -206,6 +322,8 @@ void tpool_process_destroy(tpool_process_t *q)
     pthread_cond_destroy(&q->input_empty_c);
     pthread_cond_destroy(&q->none_processing_c);
     pthread_mutex_unlock(&q->p->tpool_mu);
+    tpool_result_list_free(q->result_free);
+    tpool_result_list_free(q->result_ret);
     free(q);
     return;
 }
@@ -231,7 +349,10 @@ void tpool_process_attach(tpool_t *p, tpool_process_t *q)
 void tpool_process_detach(tpool_t *p, tpool_process_t *q) 
 {
     pthread_mutex_lock(&p->tpool_mu);
-    if (!p->q_head || !q->next || !q->prev ) return;
+    if (!p->q_head || !q->next || !q->prev ) {
+        pthread_mutex_unlock(&p->tpool_mu);
+        return;
+    }
     tpool_process_t *curr = p->q_head, *first = curr;
     do {
         /* find and detach */
@@ -256,6 +377,13 @@ int tpool_process_flush(tpool_process_t *q)
 {
     tpool_t *p = q->p;
     pthread_mutex_lock(&p->tpool_mu);
+    if (p->ws) {
+        /* the worker finishing the last job broadcasts under the lock, so the wakeup is not lost */
+        while (__atomic_load_n(&q->ws_pending, __ATOMIC_ACQUIRE) && !q->shutdown)
+            pthread_cond_wait(&q->none_processing_c, &p->tpool_mu);
+        pthread_mutex_unlock(&p->tpool_mu);
+        return 0;
+    }
     for (int i = 0; i < p->tsize; i++) {
         if (p->t_stack[i])
             pthread_cond_signal(&p->t[i].pending_c);
@@ -290,6 +418,14 @@ int tpool_process_flush(tpool_process_t *q)
     return 0;
 }
 
+/* Wall clock in microseconds, for the busy time of the workers */
+long long tpool_now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 static void *tpool_worker(void *arg)
 {
     tpool_worker_t *w = (tpool_worker_t *)arg;
@@ -320,7 +456,6 @@ static void *tpool_worker(void *arg)
 
             /* Finish and find new stack top */
             p->t_stack[w->idx] = 0;
-            int i;
             p->t_stack_top = -1;
             for (int i = 0; i < p->tsize; ++i) {
                 if (p->t_stack[i]) {
@@ -345,8 +480,12 @@ static void *tpool_worker(void *arg)
             if (q->n_job == 0) pthread_cond_broadcast(&q->input_empty_c);
             p->njobs--;
             pthread_mutex_unlock(&p->tpool_mu);
-            if (tpool_add_result(j, j->func(j->arg)) < 0) goto err;
-            free(j);
+            long long t0 = tpool_now();
+            void *data = j->func(j->arg);
+            w->busy_time += tpool_now() - t0;
+            w->n_jobs++;
+            if (tpool_add_result(j, data) < 0) goto err;
+            tpool_job_put(p, j);
             pthread_mutex_lock(&p->tpool_mu);
         }
         if (--q->ref_count == 0) {
@@ -371,6 +510,171 @@ err:
     return NULL;
 }
 
+/* Take the job at the top of a ring, by its owner or a thief; NULL when it is empty or another worker won the race */
+static tpool_job_t *tpool_deque_steal(struct tpool_deque *d, bool *raced)
+{
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b) return NULL;
+    tpool_job_t *j = __atomic_load_n(&d->buf[t & (TPOOL_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        *raced = true;
+        return NULL;
+    }
+    return j;
+}
+
+/* Dispatcher side: false when the deque is full */
+static bool tpool_deque_push(struct tpool_deque *d, tpool_job_t *j)
+{
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    if (b - t >= TPOOL_DEQUE_SIZE) return false;
+    __atomic_store_n(&d->buf[b & (TPOOL_DEQUE_SIZE - 1)], j, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* The own deque first, then a few random victims; tpool_ws_any makes the full sweep before sleeping */
+static tpool_job_t *tpool_ws_find(tpool_t *p, int idx, uint32_t *seed)
+{
+    bool raced = false;
+    tpool_job_t *j = tpool_deque_steal(&p->deque[idx], &raced);
+    if (j) return j;
+    for (int i = 0; i < TPOOL_WS_VICTIMS && p->tsize > 1; i++) {
+        *seed ^= *seed << 13;
+        *seed ^= *seed >> 17;
+        *seed ^= *seed << 5;
+        int v = *seed % p->tsize;
+        if (v != idx && (j = tpool_deque_steal(&p->deque[v], &raced))) return j;
+    }
+    return NULL;
+}
+
+static bool tpool_ws_any(tpool_t *p)
+{
+    for (int i = 0; i < p->tsize; i++) {
+        if (__atomic_load_n(&p->deque[i].top, __ATOMIC_SEQ_CST) < __atomic_load_n(&p->deque[i].bottom, __ATOMIC_SEQ_CST))
+            return true;
+    }
+    return false;
+}
+
+static void *tpool_ws_worker(void *arg)
+{
+    tpool_worker_t *w = (tpool_worker_t *)arg;
+    tpool_t *p = w->p;
+    uint32_t seed = 2654435761u * (w->idx + 1);
+    int spins = 0;
+
+    while (!__atomic_load_n(&p->shutdown, __ATOMIC_ACQUIRE)) {
+        tpool_job_t *j = tpool_ws_find(p, w->idx, &seed);
+        if (!j) {
+            if (++spins < TPOOL_WS_SPINS) {
+                sched_yield();
+                continue;
+            }
+            /* announce the sleep before the last look, the dispatcher checks nwaiting after its push */
+            pthread_mutex_lock(&p->tpool_mu);
+            __atomic_add_fetch(&p->nwaiting, 1, __ATOMIC_SEQ_CST);
+            if (!p->shutdown && !tpool_ws_any(p)) pthread_cond_wait(&p->ws_c, &p->tpool_mu);
+            __atomic_sub_fetch(&p->nwaiting, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&p->tpool_mu);
+            spins = 0;
+            continue;
+        }
+        spins = 0;
+        tpool_process_t *q = j->q;
+        long long t0 = tpool_now();
+        void *data = j->func(j->arg);
+        w->busy_time += tpool_now() - t0;
+        w->n_jobs++;
+        if (!q->in_only && tpool_add_result(j, data) < 0) {
+            tpool_job_put(p, j);
+            tpool_process_shutdown(q);
+            break;
+        }
+        tpool_job_put(p, j);
+        /* the last job is counted down under the lock, flush may free q as soon as it sees zero */
+        int pending = __atomic_load_n(&q->ws_pending, __ATOMIC_RELAXED);
+        while (pending > 1 && !__atomic_compare_exchange_n(&q->ws_pending, &pending, pending - 1, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+        if (pending <= 1) {
+            pthread_mutex_lock(&p->tpool_mu);
+            if (__atomic_sub_fetch(&q->ws_pending, 1, __ATOMIC_ACQ_REL) == 0)
+                pthread_cond_broadcast(&q->none_processing_c);
+            if (q->ws_waiting) pthread_cond_signal(&q->input_not_full_c);
+            pthread_mutex_unlock(&p->tpool_mu);
+        } else {
+            /* pairs with the fence of tpool_ws_wait: the dispatcher sees the decrement or we see it waiting */
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&q->ws_waiting, __ATOMIC_RELAXED)) {
+                pthread_mutex_lock(&p->tpool_mu);
+                pthread_cond_signal(&q->input_not_full_c);
+                pthread_mutex_unlock(&p->tpool_mu);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* bounded like the queue of the shared list: qsize waiting or finished but unread, plus one running per worker */
+static bool tpool_ws_over(tpool_t *p, tpool_process_t *q)
+{
+    return __atomic_load_n(&q->ws_pending, __ATOMIC_SEQ_CST) + __atomic_load_n(&q->n_result, __ATOMIC_ACQUIRE) >= q->qsize + p->tsize;
+}
+
+/* only the dispatcher pushes, so a ring found with room keeps it */
+static bool tpool_ws_rings_full(tpool_t *p)
+{
+    for (int i = 0; i < p->tsize; i++) {
+        if (__atomic_load_n(&p->deque[i].bottom, __ATOMIC_SEQ_CST) - __atomic_load_n(&p->deque[i].top, __ATOMIC_SEQ_CST) < TPOOL_DEQUE_SIZE)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Sleep until a worker finishes a job or a result is read, the only events
+ * that make room. The flag is raised before the last look, so a worker
+ * counting down without the lock sees it and takes the lock to signal;
+ * results are read under the lock already. tpool_wake_dispatch lifts the
+ * bound for one job, as with the shared queue, but not the size of the rings.
+ */
+static int tpool_ws_wait(tpool_t *p, tpool_process_t *q)
+{
+    pthread_mutex_lock(&p->tpool_mu);
+    __atomic_store_n(&q->ws_waiting, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (!q->shutdown && ((tpool_ws_over(p, q) && !q->wake_dispatch) || tpool_ws_rings_full(p)))
+        pthread_cond_wait(&q->input_not_full_c, &p->tpool_mu);
+    __atomic_store_n(&q->ws_waiting, 0, __ATOMIC_RELAXED);
+    q->wake_dispatch = 0;
+    int ret = q->shutdown || q->no_more_input ? -1 : 0;
+    pthread_mutex_unlock(&p->tpool_mu);
+    return ret;
+}
+
+static int tpool_ws_dispatch(tpool_t *p, tpool_process_t *q, tpool_job_t *j, bool nonblock)
+{
+    int d;
+    if (q->no_more_input || q->shutdown) return -1;
+    if ((tpool_ws_over(p, q) || tpool_ws_rings_full(p)) && (nonblock || tpool_ws_wait(p, q) < 0)) return -1;
+    j->serial = q->curr_serial++;
+    __atomic_add_fetch(&q->ws_pending, 1, __ATOMIC_ACQ_REL);
+    do {
+        d = p->ws_next;
+        p->ws_next = d + 1 == p->tsize ? 0 : d + 1;
+    } while (!tpool_deque_push(&p->deque[d], j));
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&p->nwaiting, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&p->tpool_mu);
+        pthread_cond_signal(&p->ws_c);
+        pthread_mutex_unlock(&p->tpool_mu);
+    }
+    return 0;
+}
+
 int tpool_process_reset(tpool_process_t *q, bool _free)
 {
     tpool_job_t *j, *jn, *jhead;
@@ -394,7 +698,7 @@ int tpool_process_reset(tpool_process_t *q, bool _free)
     for (j = jhead; j; j = jn) {
         jn = j->next;
         if (j->job_cleanup) j->job_cleanup(j->arg);
-        free(j);
+        tpool_job_put(q->p, j);
     }
 
     for (r = rhead; r; r = rn) {
@@ -403,7 +707,7 @@ int tpool_process_reset(tpool_process_t *q, bool _free)
         if (r && _free) {
             free(r->data);
             r->data = NULL;
-            free(r);
+            tpool_result_put(q, r);
         }
     }
     /* Wait for any jobs being processed to complete */
@@ -423,7 +727,7 @@ int tpool_process_reset(tpool_process_t *q, bool _free)
         if (r && _free) {
             free(r->data);
             r->data = NULL;
-            free(r);
+            tpool_result_put(q, r);
         }
     }
     return 0;
@@ -439,12 +743,27 @@ int tpool_dispatch(tpool_t *p,
                    bool nonblock)
 {
     tpool_job_t *j;
+    if (p->ws) {
+        if (!(j = tpool_job_get(p))) return -1;
+        j->func = func;
+        j->arg = arg;
+        j->job_cleanup = job_cleanup;
+        j->result_cleanup = result_cleanup;
+        j->next = NULL;
+        j->p = p;
+        j->q = q;
+        if (tpool_ws_dispatch(p, q, j, nonblock) < 0) {
+            tpool_job_put(p, j);
+            return -1;
+        }
+        return 0;
+    }
     pthread_mutex_lock(&p->tpool_mu);
-    if ((q->no_more_input || q->n_job >= q->qsize  && nonblock)) {
+    if (q->no_more_input || (q->n_job >= q->qsize && nonblock)) {
         pthread_mutex_unlock(&p->tpool_mu);;
         return -1;
     }
-    if (!(j = malloc(sizeof(*j)))) {
+    if (!(j = tpool_job_get(p))) {
         pthread_mutex_unlock(&p->tpool_mu);
         return -1;
     }
@@ -457,11 +776,11 @@ int tpool_dispatch(tpool_t *p,
     j->q = q;
     j->serial = q->curr_serial++;
     if (!nonblock) {
-        while (q->no_more_input || q->n_job >= q->qsize && !q->shutdown && !q->wake_dispatch) {
+        while (q->no_more_input || (q->n_job >= q->qsize && !q->shutdown && !q->wake_dispatch)) {
             pthread_cond_wait(&q->input_not_full_c, &q->p->tpool_mu);
         }
         if (q->no_more_input || q->shutdown) {
-            free(j);
+            tpool_job_put(p, j);
             pthread_mutex_unlock(&p->tpool_mu);
             return -1;
         }
@@ -503,7 +822,6 @@ static void wake_next_worker(tpool_process_t *q, bool locked)
     p->q_head = q;
     assert(p->njobs == q->n_job);
 
-    int running = p->tsize - p->nwaiting;
     int sig = p->t_stack_top >= 0 && p->njobs > p->tsize - p->nwaiting && (q->n_processing < q->qsize - q->n_result);
 
     if (sig) {
@@ -521,7 +839,7 @@ static int tpool_add_result(tpool_job_t *j, void *data)
     tpool_result_t *r;
     pthread_mutex_lock(&p->tpool_mu);
     
-    if (--q->n_processing == 0) {
+    if (!p->ws && --q->n_processing == 0) {
         int r;
         if ((r = pthread_cond_signal(&q->none_processing_c)))
             printf("output_avail_c signal failed with code %d\n", r);
@@ -531,7 +849,7 @@ static int tpool_add_result(tpool_job_t *j, void *data)
         return 0;
     }
     
-    r = malloc(sizeof(*r));
+    r = tpool_result_get(q);
     if (!r) {
         pthread_mutex_unlock(&p->tpool_mu);
         tpool_process_shutdown(q);
@@ -542,6 +860,7 @@ static int tpool_add_result(tpool_job_t *j, void *data)
     r->data = data;
     r->result_cleanup = j->result_cleanup;
     r->serial = j->serial;
+    r->q = q;
 
     q->n_result++;
     if (q->result_tail) {
@@ -585,6 +904,7 @@ tpool_result_t *tpool_next_result(tpool_process_t *q)
 
         q->next_serial++;
         q->n_result--;
+        if (p->ws && q->ws_waiting) pthread_cond_signal(&q->input_not_full_c);
 
         if (q->qsize && q->n_result < q->qsize) {
             if (q->n_job < q->qsize)
@@ -667,7 +987,7 @@ void tpool_delete_result(tpool_result_t *r, int free_data)
     if (free_data && r->data)
         free(r->data);
 
-    free(r);
+    tpool_result_put(r->q, r);
 }
 
 void *tpool_result_data(tpool_result_t *r) 
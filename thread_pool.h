@@ -39,6 +39,20 @@ DEALINGS IN THE SOFTWARE.  */
  *
  * To see example usage, please look at the #ifdef TEST_MAIN code in
  * thread_pool.c.
+ *
+ * tpool_init_ws creates a pool with the same interface that schedules by
+ * work stealing: each worker has a bounded ring, the dispatcher pushes
+ * jobs round-robin to their bottom, and workers take jobs from the top of
+ * their own ring, then steal from the top of random other rings. Only
+ * sleeping on an empty pool and returning results go through tpool_mu.
+ * Jobs must be dispatched from a single thread, which sleeps on
+ * input_not_full_c while the queue bound or every ring is full. Jobs whose
+ * results are read back cost more to dispatch than with the shared queue:
+ * each result still takes the lock, on top of the ring traffic.
+ *
+ * Jobs and results are recycled through free lists of the pool and of the
+ * process, so that a steady stream of dispatches does not malloc or free.
+ * Results must be deleted before their process is destroyed.
  */
 
 #ifndef THREAD_POOL_H
@@ -84,6 +98,19 @@ struct tpool {
     int n_count, n_running;
 
     long long total_time, wait_time;
+
+    /* work-stealing pools: one ring per worker, filled round-robin by the dispatcher */
+    bool ws;
+    struct tpool_deque *deque;
+    int ws_next;
+    pthread_cond_t ws_c; /* idle workers sleep here */
+
+    /* finished jobs are recycled: workers push them on job_ret without the lock,
+       the dispatcher moves them to job_free and takes from there;
+       recycle is true unless a benchmark compares against malloc and free */
+    bool recycle;
+    tpool_job_t *job_free;
+    tpool_job_t *job_ret;
 };
 
 /**
@@ -107,6 +134,8 @@ struct tpool_process {
     int n_job; /* no. items in input queue; was njobs */
     int n_result; /* no. items in output queue; was nresult */
     int n_processing; /* no. items being proessed */
+    int ws_pending; /* no. items queued or running, work-stealing pools only */
+    int ws_waiting; /* the dispatcher sleeps on input_not_full_c, work-stealing pools only */
 
     bool shutdown; /* true if the thread pool is destroyed */
     bool in_only;  /* if true, don't queue result up */
@@ -119,6 +148,10 @@ struct tpool_process {
     pthread_cond_t input_empty_c;    /* Input queue has become empty */
     pthread_cond_t none_processing_c;/* n_processing has hit zero */
 
+    /* deleted results, pushed on result_ret without the lock and reused under tpool_mu */
+    tpool_result_t *result_free;
+    tpool_result_t *result_ret;
+
     tpool_process_t *next, *prev; /* the process forms a circular linked-list */
 };
 
@@ -131,6 +164,8 @@ struct tpool_worker {
     int idx;
     pthread_t tid;
     pthread_cond_t pending_c;
+    long long busy_time; /* microseconds spent running jobs */
+    int n_jobs;          /* jobs run by this worker */
 };
 
 /**
@@ -154,12 +189,14 @@ struct tpool_result {
     void *data;
     uint64_t serial; /* serial number for ordering */
     tpool_result_t *next;
+    tpool_process_t *q; /* the result goes back to its process when deleted */
 };
 
 
 tpool_process_t *tpool_process_init(tpool_t *p, int qsize, bool in_only);
 void tpool_process_destroy(tpool_process_t *q);
 tpool_t* tpool_init(int n);
+tpool_t* tpool_init_ws(int n);
 void tpool_destroy(tpool_t *p);
 static void *tpool_worker(void *arg);
 static int tpool_add_result(tpool_job_t *j, void *data);
@@ -178,6 +215,7 @@ int tpool_dispatch(tpool_t *p,
                    void (*result_cleanup)(void *data),
                    bool nonblock);
 tpool_result_t *tpool_next_result(tpool_process_t *q);
+long long tpool_now(void);
 tpool_result_t *tpool_next_result_wait(tpool_process_t *q);
 bool tpool_process_empty(tpool_process_t *q);
 static void tpool_process_shutdown(tpool_process_t *q);
@@ -9,6 +9,7 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <limits.h>
+#include <sched.h>
 #include "thread_pool.h"
 
 
@@ -27,8 +28,206 @@ void *doit_square_u(void *arg) {
 }
 
 
+/* Lengths of the human chromosomes in Mb, a job sleeps 100us per Mb */
+static const int chrom_mb[] = {248, 242, 198, 190, 181, 171, 159, 145, 138, 134, 135, 133,
+                               114, 107, 102, 90, 83, 80, 59, 64, 47, 51, 156, 57};
+#define N_CHROM (sizeof(chrom_mb) / sizeof(chrom_mb[0]))
+
+/* Jobs that ran, counted by the jobs themselves */
+static int jobs_ran;
+
+void *doit_sleep(void *arg) {
+    usleep(*(int *)arg * 100);
+    __atomic_add_fetch(&jobs_ran, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/**
+ * @brief Dispatch n jobs of func, job i taking args[i] (NULL for none),
+ * and flush. When q keeps its results they are read as they come and
+ * must come back in dispatch order. Returns the wall time from the first
+ * dispatch to the flush, after checking that every job ran.
+ */
+static long long run_jobs(tpool_t *p, tpool_process_t *q, void *(*func)(void *), void **args, int n)
+{
+    tpool_result_t *r;
+    int n_results = 0;
+    jobs_ran = 0;
+    long long t0 = tpool_now();
+    for (int i = 0; i < n; ++i) {
+        while (tpool_dispatch(p, q, func, args ? args[i] : NULL, NULL, NULL, true) == -1) {
+            if (q->in_only) sched_yield();
+            else if ((r = tpool_next_result_wait(q))) {
+                assert(r->serial == n_results++);
+                tpool_delete_result(r, false);
+            }
+        }
+        while (!q->in_only && (r = tpool_next_result(q))) {
+            assert(r->serial == n_results++);
+            tpool_delete_result(r, false);
+        }
+    }
+    tpool_process_flush(q);
+    long long t = tpool_now() - t0;
+    while (!q->in_only && (r = tpool_next_result(q))) {
+        assert(r->serial == n_results++);
+        tpool_delete_result(r, false);
+    }
+    assert(__atomic_load_n(&jobs_ran, __ATOMIC_RELAXED) == n);
+    assert(q->in_only || n_results == n);
+    return t;
+}
+
+static int cmp_desc(const void *a, const void *b)
+{
+    return *(const int *)b - *(const int *)a;
+}
+
+/* Makespan of the chromosome jobs in the given order on n threads */
+static long long schedule_run(int *mb, int n)
+{
+    tpool_t *p = tpool_init(n);
+    tpool_process_t *q = tpool_process_init(p, 16, true);
+    void *args[N_CHROM];
+    for (int i = 0; i < N_CHROM; ++i) args[i] = &mb[i];
+    long long makespan = run_jobs(p, q, doit_sleep, args, N_CHROM);
+    for (int i = 0; i < n; ++i) {
+        printf("  thread %d: %2d jobs, idle %6.1f ms\n", i, p->t[i].n_jobs, (makespan - p->t[i].busy_time) / 1e3);
+    }
+    tpool_process_destroy(q);
+    tpool_destroy(p);
+    return makespan;
+}
+
+/* Jobs sleep rather than spin, so the schedule shows even on a machine with few cores */
+static void schedule_bench(int n)
+{
+    int hashed[N_CHROM], lpt[N_CHROM];
+    memcpy(hashed, chrom_mb, sizeof(chrom_mb));
+    memcpy(lpt, chrom_mb, sizeof(chrom_mb));
+    /* stands in for the order of kh_foreach */
+    srand(11);
+    for (int i = N_CHROM - 1; i > 0; --i) {
+        int k = rand() % (i + 1), t = hashed[i];
+        hashed[i] = hashed[k];
+        hashed[k] = t;
+    }
+    qsort(lpt, N_CHROM, sizeof(int), cmp_desc);
+    printf("hash order, %d threads\n", n);
+    long long a = schedule_run(hashed, n);
+    printf("  makespan %.1f ms\n", a / 1e3);
+    printf("largest first, %d threads\n", n);
+    long long b = schedule_run(lpt, n);
+    printf("  makespan %.1f ms (%.1f%% of hash order)\n", b / 1e3, 100.0 * b / a);
+    /* largest first never does worse, up to the timer slack of the sleeps */
+    assert(b <= a * 1.05 + 2000);
+}
+
+/* A job of a few hundred nanoseconds, so that the cost of scheduling shows */
+void *doit_tiny(void *arg) {
+    volatile int x = 0;
+    for (int i = 0; i < 100; ++i) x += i;
+    __atomic_add_fetch(&jobs_ran, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+#define CONTENTION_JOBS 200000
+
+/* Wall time per job of CONTENTION_JOBS tiny jobs, dispatch to flush */
+static double contention_run(int n, bool ws)
+{
+    tpool_t *p = ws ? tpool_init_ws(n) : tpool_init(n);
+    tpool_process_t *q = tpool_process_init(p, 256, true);
+    double ns = run_jobs(p, q, doit_tiny, NULL, CONTENTION_JOBS) * 1e3 / CONTENTION_JOBS;
+    tpool_process_destroy(q);
+    tpool_destroy(p);
+    return ns;
+}
+
+static int blocker_released;
+
+void *doit_blocker(void *arg) {
+    while (!__atomic_load_n(&blocker_released, __ATOMIC_ACQUIRE)) usleep(1000);
+    return NULL;
+}
+
+/**
+ * @brief The results of a process are read in dispatch order, so a slow
+ * first job holds back all the later ones. The finished but unread
+ * results must stop the dispatch, instead of piling up without bound.
+ */
+static void result_bound_check(bool ws)
+{
+    const int n = 2, qsize = 4;
+    tpool_t *p = ws ? tpool_init_ws(n) : tpool_init(n);
+    tpool_process_t *q = tpool_process_init(p, qsize, false);
+    tpool_result_t *r;
+    int accepted = 0;
+    blocker_released = 0;
+    if (tpool_dispatch(p, q, doit_blocker, NULL, NULL, NULL, false) == -1) abort();
+    for (int i = 0; i < 10 * (qsize + n); ++i) {
+        if (tpool_dispatch(p, q, doit_tiny, NULL, NULL, NULL, true) == -1) break;
+        accepted++;
+        usleep(1000); /* lets the tiny job finish, its result stays unread */
+    }
+    __atomic_store_n(&blocker_released, 1, __ATOMIC_RELEASE);
+    tpool_process_flush(q);
+    while ((r = tpool_next_result(q))) tpool_delete_result(r, false);
+    fprintf(stderr, "%s: %d jobs accepted behind a blocked one, queue size %d, %d threads\n", ws ? "work stealing" : "shared queue", accepted, qsize, n);
+    /* the shared queue holds up to qsize jobs besides qsize results or running jobs, work stealing less */
+    assert(accepted + 1 <= 2 * qsize + n);
+    tpool_process_destroy(q);
+    tpool_destroy(p);
+}
+
+static void contention_bench(int max_threads)
+{
+    result_bound_check(false);
+    result_bound_check(true);
+    printf("threads\tshared queue ns/job\twork stealing ns/job\n");
+    for (int n = 1; n <= max_threads; n *= 2) {
+        double a = contention_run(n, false);
+        double b = contention_run(n, true);
+        printf("%d\t%.0f\t%.0f\n", n, a, b);
+    }
+}
+
+/* Jobs per second through dispatch, run and result, the results read back in order; with or without the free lists */
+static double dispatch_run(int n, bool ws, bool recycle)
+{
+    tpool_t *p = ws ? tpool_init_ws(n) : tpool_init(n);
+    p->recycle = recycle;
+    tpool_process_t *q = tpool_process_init(p, 256, false);
+    double rate = CONTENTION_JOBS / (run_jobs(p, q, doit_tiny, NULL, CONTENTION_JOBS) / 1e6);
+    tpool_process_destroy(q);
+    tpool_destroy(p);
+    return rate;
+}
+
+static void dispatch_bench(int n)
+{
+    printf("scheduler\tmalloc jobs/s\tpooled jobs/s\n");
+    printf("shared queue\t%.0f\t%.0f\n", dispatch_run(n, false, false), dispatch_run(n, false, true));
+    printf("work stealing\t%.0f\t%.0f\n", dispatch_run(n, true, false), dispatch_run(n, true, true));
+}
+
 int main(int argc, char const *argv[])
 {
+    /* thread_pool_test dispatch [threads]: jobs with results, read back in order, malloc'd against recycled */
+    if (argc > 1 && strcmp(argv[1], "dispatch") == 0) {
+        dispatch_bench(argc > 2 ? atoi(argv[2]) : 4);
+        return 0;
+    }
+    /* thread_pool_test contention [max threads]: shared queue against work stealing */
+    if (argc > 1 && strcmp(argv[1], "contention") == 0) {
+        contention_bench(argc > 2 ? atoi(argv[2]) : 64);
+        return 0;
+    }
+    /* thread_pool_test schedule [threads]: hash order against largest first */
+    if (argc > 1 && strcmp(argv[1], "schedule") == 0) {
+        schedule_bench(argc > 2 ? atoi(argv[2]) : 8);
+        return 0;
+    }
 
     pthread_setconcurrency(2);
     tpool_t *p = tpool_init(1);
@@ -43,4 +43,4 @@
     fprintf(stderr, fmt, ## args); \
     fprintf(stderr, "\033[0m\n"); \
     exit(1); \
-} while (0);
\ No newline at end of file
+} while (0);